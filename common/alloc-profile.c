@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * Thunder is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3, or (at
+ * your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Authors:
+ *      Marc Nieper-Wißkirchen
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitrotate.h"
+#include "minmax.h"
+#include "vmcommon.h"
+#include "xalloc.h"
+
+/* The samples taken at one site for one type of objects.  Each sample
+   stands for the INTERVAL bytes allocated up to it, so BYTES and
+   OBJECTS estimate what has been allocated there. */
+typedef struct alloc_site AllocSite;
+struct alloc_site
+{
+  void const *site;
+  char const *type;
+  size_t samples;
+  size_t bytes;
+  size_t objects;
+};
+
+static bool
+comparator (void const *entry1, void const *entry2)
+{
+  AllocSite const *site1 = entry1;
+  AllocSite const *site2 = entry2;
+  return site1->site == site2->site && site1->type == site2->type;
+}
+
+static size_t
+hasher (void const *entry, size_t n)
+{
+  AllocSite const *site = entry;
+  return (rotr_sz ((size_t) site->site, 3) ^ (size_t) site->type) % n;
+}
+
+void
+alloc_profile_init (AllocProfile *profile)
+{
+  profile->interval = 0;
+  profile->countdown = PTRDIFF_MAX;
+  if ((profile->sites = hash_initialize (0, NULL, hasher, comparator, free)) == NULL)
+    xalloc_die ();
+  profile->report = NULL;
+}
+
+void
+alloc_profile_destroy (AllocProfile *profile)
+{
+  if (profile->report != NULL)
+    {
+      alloc_profile_write (profile, profile->report);
+      fclose (profile->report);
+    }
+  hash_free (profile->sites);
+}
+
+/* Start sampling every INTERVAL bytes. */
+void
+alloc_profile_start (AllocProfile *profile, size_t interval)
+{
+  profile->interval = interval;
+  profile->countdown = interval;
+}
+
+/* Take a sample of an allocation of BYTES bytes of objects of TYPE at
+   SITE, which has used up the countdown. */
+void
+alloc_profile_sample (AllocProfile *profile, void const *site, char const *type, size_t bytes)
+{
+  /* An object larger than the interval stands for several samples. */
+  size_t samples = 1 + -profile->countdown / profile->interval;
+  profile->countdown += (ptrdiff_t) (samples * profile->interval);
+
+  AllocSite *entry = XMALLOC (AllocSite);
+  *entry = (AllocSite) { .site = site, .type = type };
+  AllocSite *old;
+  switch (hash_insert_if_absent (profile->sites, entry, (void const **) &old))
+    {
+    case -1:
+      xalloc_die ();
+    case 0:
+      free (entry);
+      entry = old;
+      break;
+    }
+  entry->samples += samples;
+  entry->bytes += samples * profile->interval;
+  entry->objects += MAX (samples * profile->interval / bytes, 1);
+}
+
+static int
+compare_bytes (void const *entry1, void const *entry2)
+{
+  AllocSite const *site1 = *(AllocSite *const *) entry1;
+  AllocSite const *site2 = *(AllocSite *const *) entry2;
+  return (site1->bytes < site2->bytes) - (site1->bytes > site2->bytes);
+}
+
+/* Write the estimated bytes and objects allocated per site and type
+   to OUT, most bytes first. */
+void
+alloc_profile_write (AllocProfile *profile, FILE *out)
+{
+  size_t count = hash_get_n_entries (profile->sites);
+  AllocSite **sites = XNMALLOC (count, AllocSite *);
+  hash_get_entries (profile->sites, (void **) sites, count);
+  qsort (sites, count, sizeof (AllocSite *), compare_bytes);
+
+  fprintf (out, "# Allocations sampled every %zu bytes\n", profile->interval);
+  fprintf (out, "%14s %12s %8s  %-8s %s\n", "bytes", "objects", "samples", "type", "site");
+  for (size_t i = 0; i < count; ++i)
+    fprintf (out, "%14zu %12zu %8zu  %-8s %p\n", sites[i]->bytes, sites[i]->objects,
+	     sites[i]->samples, sites[i]->type, sites[i]->site);
+  fflush (out);
+  free (sites);
+}
@@ -0,0 +1,527 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * Thunder is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3, or (at
+ * your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Authors:
+ *      Marc Nieper-Wißkirchen
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deque.h"
+#include "gc.h"
+#include "minmax.h"
+#include "stack.h"
+#include "vmcommon.h"
+#include "xalloc.h"
+
+/* The mark bitmap of the compactor is divided into blocks of
+   BLOCK_GRANULES granules. */
+#define BLOCK_GRANULES 64
+
+/* An incremental marking slice checks its budget after tracing this
+   number of objects. */
+#define DRAIN_CHECK_INTERVAL 256
+
+/* State of a sliding compaction of the tenured space.  LIVE has a bit
+   for each granule of a marked object.  DESTINATIONS holds the
+   address the first live granule of each block is moved to. */
+struct compactor
+{
+  Heap *heap;
+  uint64_t *live;
+  Pointer *destinations;
+  size_t granule_count;
+  size_t block_count;
+  STACK(Pointer) marks;
+  STACK(Pointer) ephemerons;
+};
+
+static size_t
+granule (Compactor *compactor, Pointer pointer)
+{
+  return (pointer - compactor->heap->start) / GRANULE_WORDS;
+}
+
+static bool
+is_live (Compactor *compactor, size_t granule)
+{
+  return compactor->live[granule / BLOCK_GRANULES] >> (granule % BLOCK_GRANULES) & 1;
+}
+
+/* Return the first live granule at or after GRANULE. */
+static size_t
+next_live (Compactor *compactor, size_t granule)
+{
+  while (granule < compactor->granule_count)
+    {
+      uint64_t bits = compactor->live[granule / BLOCK_GRANULES] >> (granule % BLOCK_GRANULES);
+      if (bits != 0)
+	return granule + __builtin_ctzll (bits);
+      granule = (granule / BLOCK_GRANULES + 1) * BLOCK_GRANULES;
+    }
+  return compactor->granule_count;
+}
+
+static void
+compactor_init (Compactor *compactor, Heap *heap)
+{
+  compactor->heap = heap;
+  compactor->granule_count = (heap->free - heap->start) / GRANULE_WORDS;
+  compactor->block_count = (compactor->granule_count + BLOCK_GRANULES - 1) / BLOCK_GRANULES;
+  compactor->live = XCALLOC (compactor->block_count, uint64_t);
+  compactor->destinations = NULL;
+  /* The frozen objects are kept where they are. */
+  size_t frozen = granule (compactor, heap->frozen);
+  memset (compactor->live, 0xff, frozen / BLOCK_GRANULES * sizeof (uint64_t));
+  if (frozen % BLOCK_GRANULES != 0)
+    compactor->live[frozen / BLOCK_GRANULES] = (1ULL << (frozen % BLOCK_GRANULES)) - 1;
+  stack_init (&compactor->marks);
+  stack_init (&compactor->ephemerons);
+}
+
+static void
+compactor_destroy (Compactor *compactor)
+{
+  stack_destroy (&compactor->ephemerons);
+  stack_destroy (&compactor->marks);
+  free (compactor->destinations);
+  free (compactor->live);
+}
+
+static void
+set_live (Compactor *compactor, Pointer header)
+{
+  size_t first = granule (compactor, header);
+  size_t last = first + object_size (header) / GRANULE_WORDS;
+  for (size_t i = first; i < last; ++i)
+    compactor->live[i / BLOCK_GRANULES] |= 1ULL << (i % BLOCK_GRANULES);
+}
+
+/* Mark OBJECT and queue it for tracing unless it has been marked
+   before.  Objects promoted after the marking started lie above the
+   bitmap and are live anyway. */
+void
+compactor_shade (Compactor *compactor, Object object)
+{
+  Heap *heap = compactor->heap;
+  if (!is_pointer (object) || is_well_known_symbol ((Pointer) object))
+    return;
+
+  Pointer pointer = (Pointer) object;
+  if (pointer >= heap->start && pointer < heap->start + compactor->granule_count * GRANULE_WORDS)
+    {
+      Pointer header = object_header (pointer);
+      if (is_live (compactor, granule (compactor, header)))
+	return;
+      set_live (compactor, header);
+      stack_push (&compactor->marks, header);
+    }
+  else if (large_object_space_contains (&heap->large_object_space, pointer))
+    {
+      Pointer header = object_header (pointer);
+      if (large_object_space_trace (&heap->large_object_space, header))
+	stack_push (&compactor->marks, header);
+    }
+  else if (is_unmanaged (pointer))
+    {
+      switch (header_type (pointer))
+	{
+#define ENTRY(id, type, init, destroy)					\
+	  case TYPE(id):						\
+	    resource_manager_trace (id, (Resource(id) *) (pointer - 1));	\
+	    break;
+	  RESOURCES
+#undef ENTRY
+	}
+    }
+}
+
+static void
+compactor_mark (Compactor *compactor, Object *object)
+{
+  compactor_shade (compactor, *object);
+}
+
+/* Return the address the live object at HEADER is moved to. */
+static Pointer
+compactor_forward (Compactor *compactor, Pointer header)
+{
+  size_t i = granule (compactor, header);
+  uint64_t below = compactor->live[i / BLOCK_GRANULES] & ((1ULL << (i % BLOCK_GRANULES)) - 1);
+  return compactor->destinations[i / BLOCK_GRANULES] + __builtin_popcountll (below) * GRANULE_WORDS;
+}
+
+static void
+compactor_update (Compactor *compactor, Object *object)
+{
+  Heap *heap = compactor->heap;
+  if (!is_pointer (*object) || is_well_known_symbol ((Pointer) *object))
+    return;
+
+  Pointer pointer = (Pointer) *object;
+  if (!is_in_heap (heap, pointer))
+    return;
+
+  /* Fields are only written to if their referents move so that the
+     pages of the frozen objects are not touched. */
+  Pointer header = object_header (pointer);
+  Object forwarded = (Object) (compactor_forward (compactor, header) + (pointer - header));
+  if (*object != forwarded)
+    *object = forwarded;
+}
+
+/* Apply FUNCTION to each pointer field of the object at REF. */
+static void
+compactor_visit (Compactor *compactor, Pointer ref, void (*function) (Compactor *, Object *))
+{
+  if (is_ephemeron_header (*ref))
+    {
+      function (compactor, ref + 1);
+      function (compactor, ref + 2);
+      return;
+    }
+
+  Pointer start = object_pointers (ref);
+  if (start == NULL)
+    return;
+  for (Pointer p = start; p < ref + object_size (ref); ++p)
+    function (compactor, p);
+}
+
+/* Apply FUNCTION to each pointer field of the survivors, which are
+   not marked, but refer to the tenured space like roots. */
+static void
+compactor_visit_survivors (Compactor *compactor, void (*function) (Compactor *, Object *))
+{
+  Heap *heap = compactor->heap;
+  for (size_t i = 1; i < TENURING_THRESHOLD_MAX; ++i)
+    for (Pointer ref = heap->survivors[i].start;
+	 ref < heap->survivors[i].free;
+	 ref += object_size (ref))
+      compactor_visit (compactor, ref, function);
+}
+
+/* Dirty the card of a field of a moved object or a large object that
+   refers to a survivor or a pinned object kept in place. */
+static void
+compactor_remember (Compactor *compactor, Object *object)
+{
+  if (is_pointer (*object) && is_kept_in_place (compactor->heap, (Pointer) *object))
+    remember (compactor->heap, object);
+}
+
+/* Return true if KEY, the key of an ephemeron, has been marked.
+   Objects the marking does not cover are live. */
+static bool
+compactor_is_key_live (Compactor *compactor, Object key)
+{
+  Heap *heap = compactor->heap;
+  if (!is_pointer (key) || is_well_known_symbol ((Pointer) key))
+    return true;
+
+  Pointer pointer = (Pointer) key;
+  if (pointer >= heap->start && pointer < heap->start + compactor->granule_count * GRANULE_WORDS)
+    return is_live (compactor, granule (compactor, object_header (pointer)));
+  if (large_object_space_contains (&heap->large_object_space, pointer))
+    return large_object_space_owner (&heap->large_object_space, pointer)->marked;
+  return true;
+}
+
+/* Trace the fields of the marked object at REF.  An ephemeron is
+   queued instead while its key has not been marked. */
+static void
+compactor_trace (Compactor *compactor, Pointer ref)
+{
+  if (is_ephemeron_header (*ref) && !compactor_is_key_live (compactor, ref[1]))
+    stack_push (&compactor->ephemerons, ref);
+  else
+    compactor_visit (compactor, ref, compactor_mark);
+}
+
+/* Mark the values of the queued ephemerons whose keys have been
+   marked since.  Return true if there were any. */
+static bool
+compactor_resolve (Compactor *compactor)
+{
+  bool resolved = false;
+  for (ptrdiff_t i = 0; i < stack_size (&compactor->ephemerons); )
+    {
+      Pointer ref = compactor->ephemerons.base[i];
+      if (!compactor_is_key_live (compactor, ref[1]))
+	{
+	  ++i;
+	  continue;
+	}
+      compactor->ephemerons.base[i] = stack_pop (&compactor->ephemerons);
+      compactor_visit (compactor, ref, compactor_mark);
+      resolved = true;
+    }
+  return resolved;
+}
+
+/* Start marking the objects reachable from ROOTS in the tenured space,
+   which the nursery has been evacuated from.  The compactor is freed
+   by compactor_finish or stop_marking. */
+Compactor *
+compactor_start (Heap *heap, Object roots[], size_t root_count)
+{
+  Compactor *compactor = XMALLOC (Compactor);
+  compactor_init (compactor, heap);
+  large_object_space_begin_marking (&heap->large_object_space);
+  resource_manager_begin_marking (&heap->resource_manager);
+  for (size_t i = 0; i < SYMBOL_COUNT; ++i)
+    compactor_mark (compactor, &symbols[i]);
+  for (size_t i = 0; i < root_count; ++i)
+    compactor_mark (compactor, &roots[i]);
+  compactor_visit_survivors (compactor, compactor_mark);
+  /* The frozen objects are live and are only traced from here. */
+  for (Pointer ref = heap->start; ref < heap->frozen; ref += object_size (ref))
+    compactor_trace (compactor, ref);
+  /* Pinned objects kept in place may be promoted during the marking
+     without being traced. */
+  Pin *pin;
+  STACK_FOREACH (&heap->pinned, pin)
+    {
+      compactor_mark (compactor, &pin->object);
+      if (is_kept_in_place (heap, (Pointer) pin->object))
+	compactor_visit (compactor, object_header ((Pointer) pin->object), compactor_mark);
+    }
+  return compactor;
+}
+
+/* Trace the queued objects for at most BUDGET seconds.  Return true if
+   the marking is complete. */
+bool
+compactor_drain (Compactor *compactor, double budget)
+{
+  double deadline = current_time () + budget;
+  for (size_t n = 1; ; ++n)
+    {
+      if (stack_is_empty (&compactor->marks))
+	{
+	  if (!compactor_resolve (compactor))
+	    return true;
+	  continue;
+	}
+      compactor_trace (compactor, stack_pop (&compactor->marks));
+      if (n % DRAIN_CHECK_INTERVAL == 0 && current_time () > deadline)
+	return false;
+    }
+}
+
+/* Return true if OBJECT, which is registered with a guardian, has
+   been marked. */
+static bool
+compactor_is_guarded_live (Compactor *compactor, Object object)
+{
+  if (!is_resource (object))
+    return compactor_is_key_live (compactor, object);
+
+  Pointer pointer = (Pointer) object;
+  switch (header_type (pointer))
+    {
+#define ENTRY(id, type, init, destroy)					\
+    case TYPE(id):							\
+      return ((Resource(id) *) (pointer - 1))->marked;
+      RESOURCES
+#undef ENTRY
+    }
+  return true;
+}
+
+/* Keep the pinned objects of the tenured space where they are by
+   marking all objects up to the end of the last one, which are traced
+   unless they have been marked before. */
+static void
+compactor_pin (Compactor *compactor)
+{
+  Heap *heap = compactor->heap;
+  Pointer end = heap->start;
+  Pin *pin;
+  STACK_FOREACH (&heap->pinned, pin)
+    if (is_in_heap (heap, (Pointer) pin->object))
+      {
+	Pointer header = object_header ((Pointer) pin->object);
+	end = MAX (end, header + object_size (header));
+      }
+  for (Pointer ref = heap->start; ref < end; ref += object_size (ref))
+    if (!is_live (compactor, granule (compactor, ref)))
+      {
+	set_live (compactor, ref);
+	stack_push (&compactor->marks, ref);
+      }
+  compactor_drain (compactor, INFINITY);
+}
+
+/* Drop the registrations with dead guardians, mark the others and
+   order them so that the ones of dead objects come last, starting at
+   the returned index.  Retaining the dead objects completes the
+   marking. */
+static ptrdiff_t
+compactor_guard (Compactor *compactor)
+{
+  Heap *heap = compactor->heap;
+  Object *base = heap->guarded.base;
+  ptrdiff_t kept = 0;
+  for (ptrdiff_t i = 0; i < stack_size (&heap->guarded); ++i)
+    if (compactor_is_key_live (compactor, ((Pointer) base[i])[1]))
+      base[kept++] = base[i];
+  heap->guarded.items = kept;
+
+  ptrdiff_t ready = kept;
+  for (ptrdiff_t i = 0; i < ready; )
+    if (compactor_is_guarded_live (compactor, ((Pointer) base[i])[0]))
+      ++i;
+    else
+      {
+	Object entry = base[i];
+	base[i] = base[--ready];
+	base[ready] = entry;
+      }
+
+  for (ptrdiff_t i = 0; i < kept; ++i)
+    compactor_shade (compactor, base[i]);
+  compactor_drain (compactor, INFINITY);
+  return ready;
+}
+
+/* Slide the live objects of the tenured space towards its start once
+   the marking is complete.  The large objects and resources are
+   collected along the way. */
+void
+compactor_finish (Compactor *compactor, Object roots[], size_t root_count)
+{
+  Heap *heap = compactor->heap;
+
+  /* Objects promoted since the marking started are live. */
+  Pointer ref = heap->start + compactor->granule_count * GRANULE_WORDS;
+  compactor->granule_count = (heap->free - heap->start) / GRANULE_WORDS;
+  size_t block_count = (compactor->granule_count + BLOCK_GRANULES - 1) / BLOCK_GRANULES;
+  compactor->live = xnrealloc (compactor->live, block_count, sizeof (uint64_t));
+  memset (compactor->live + compactor->block_count, 0,
+	  (block_count - compactor->block_count) * sizeof (uint64_t));
+  compactor->block_count = block_count;
+  for (; ref < heap->free; ref += object_size (ref))
+    set_live (compactor, ref);
+
+  compactor_pin (compactor);
+  ptrdiff_t ready = compactor_guard (compactor);
+
+  /* The ephemerons still queued have dead keys. */
+  while (!stack_is_empty (&compactor->ephemerons))
+    {
+      Pointer ephemeron = stack_pop (&compactor->ephemerons);
+      ephemeron[1] = ephemeron[2] = make_undefined ();
+    }
+  queue_guarded (heap, ready);
+
+  resource_manager_end_marking (&heap->resource_manager);
+  large_object_space_end_marking (&heap->large_object_space);
+  symbol_table_clear (&heap->symbol_table, true);
+
+  /* Compute the new addresses. */
+  compactor->destinations = XNMALLOC (compactor->block_count, Pointer);
+  Pointer destination = heap->start;
+  for (size_t i = 0; i < compactor->block_count; ++i)
+    {
+      compactor->destinations[i] = destination;
+      destination += __builtin_popcountll (compactor->live[i]) * GRANULE_WORDS;
+    }
+
+  /* Update all pointers into the tenured space. */
+  for (size_t i = 0; i < SYMBOL_COUNT; ++i)
+    compactor_update (compactor, &symbols[i]);
+  for (size_t i = 0; i < root_count; ++i)
+    compactor_update (compactor, &roots[i]);
+  for (ptrdiff_t i = 0; i < stack_size (&heap->guarded); ++i)
+    compactor_update (compactor, &heap->guarded.base[i]);
+  compactor_visit_survivors (compactor, compactor_update);
+  Pin *pin;
+  STACK_FOREACH (&heap->pinned, pin)
+    if (is_kept_in_place (heap, (Pointer) pin->object))
+      compactor_visit (compactor, object_header ((Pointer) pin->object), compactor_update);
+  bool young = survivor_words (heap) > 0 || !stack_is_empty (&heap->pinned);
+  for (size_t i = next_live (compactor, 0);
+       i < compactor->granule_count;
+       i = next_live (compactor, i + object_size (heap->start + i * GRANULE_WORDS) / GRANULE_WORDS))
+    compactor_visit (compactor, heap->start + i * GRANULE_WORDS, compactor_update);
+  for (LargeObject *object = deque_first (&heap->large_object_space.heap_list);
+       object != NULL;
+       object = object->deque_entries.next)
+    {
+      compactor_visit (compactor, large_object_start (object), compactor_update);
+      /* Ending the marking has cleaned the cards of the large
+	 objects. */
+      if (young)
+	compactor_visit (compactor, large_object_start (object), compactor_remember);
+    }
+
+  /* Slide the live objects.  An object never moves past the start of
+     the next one, so the headers still to be read stay intact. */
+  card_table_clear (&heap->card_table);
+  for (size_t i = next_live (compactor, 0); i < compactor->granule_count; )
+    {
+      Pointer from = heap->start + i * GRANULE_WORDS;
+      Pointer to = compactor_forward (compactor, from);
+      size_t size = object_size (from);
+      if (to != from)
+	{
+	  memmove (to, from, size * WORDSIZE);
+	  heap->copied += size;
+	}
+      card_table_record (heap, to, size);
+      if (young)
+	compactor_visit (compactor, to, compactor_remember);
+      if ((*to & HEADER_TYPE_MASK) == SYMBOL_TYPE)
+	symbol_table_intern (&heap->symbol_table, (Object) (to + 1), true);
+      i = next_live (compactor, i + size / GRANULE_WORDS);
+    }
+  heap->free = destination;
+
+  heap->guarded_young = first_young_guarded (heap);
+
+  large_object_space_end_gc (&heap->large_object_space, true);
+  resource_manager_end_gc (&heap->resource_manager);
+  compactor_destroy (compactor);
+  free (compactor);
+}
+
+/* Abandon an incremental marking, which is invalidated by copying the
+   tenured space. */
+void
+stop_marking (Heap *heap)
+{
+  if (heap->compactor == NULL)
+    return;
+  heap->large_object_space.marking = false;
+  heap->resource_manager.marking = false;
+  compactor_destroy (heap->compactor);
+  free (heap->compactor);
+  heap->compactor = NULL;
+}
+
+void
+shade (Heap *heap, Object object)
+{
+  if (heap->compactor != NULL)
+    compactor_shade (heap->compactor, object);
+}
+
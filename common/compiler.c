@@ -126,13 +126,15 @@ label_table_insert (LabelTable *table, jit_state_t *_jit, Object name, bool forw
 /* Trampoline stack */
 struct stack_layout {
   Vm *vm;
-  jit_pointer_t heap_base;
-  jit_pointer_t heap_end;
+  jit_pointer_t heap_limit;
   jit_word_t live_values[6];
 };
 
 static jit_int32_t stack_base;
 
+/* Set while compiling code whose allocations are to be profiled. */
+static bool profiling;
+
 #define stack_store(member, reg)					\
   _Generic(((struct stack_layout) {}).member,				\
 	   Vm *: jit_stxi (stack_base + offsetof (struct stack_layout, member), \
@@ -530,53 +532,187 @@ DEFINE_INSTRUCTION(ret)
   jit_patch_abs (jump, trampoline_return);
 }
 
+/* Count down BYTES allocated by the code of the last entry point for
+   the allocation profile, and take a sample once the countdown has
+   been used up. */
+static void
+count_allocation (jit_state_t *_jit, EntryPointVector *entry_points, size_t bytes)
+{
+  jit_int32_t const scratch = stack_base + offsetof (struct stack_layout, live_values)
+    + 3 * sizeof (jit_word_t);
+  jit_stxi (scratch, JIT_FP, JIT_R0);
+  stack_load (JIT_R3, vm);
+  jit_ldxi (JIT_R0, JIT_R3, offsetof (struct vm, heap.alloc_profile.countdown));
+  jit_subi (JIT_R0, JIT_R0, bytes);
+  jit_stxi (offsetof (struct vm, heap.alloc_profile.countdown), JIT_R3, JIT_R0);
+  jit_movr (JIT_R3, JIT_R0);
+  jit_ldxi (JIT_R0, JIT_FP, scratch);
+  jit_node_t *skip = jit_bgti (JIT_R3, 0);
+
+  jit_gpr_t const saved[] = { JIT_R0, JIT_R1, JIT_R2 };
+  for (int i = 0; i < 3; ++i)
+    jit_stxi (stack_base + offsetof (struct stack_layout, live_values)
+	      + i * sizeof (jit_word_t), JIT_FP, saved[i]);
+  jit_prepare ();
+  stack_load (JIT_R3, vm);
+  jit_addi (JIT_R3, JIT_R3, offsetof (struct vm, heap.alloc_profile));
+  jit_pushargr (JIT_R3);
+  jit_node_t *site = jit_movi (JIT_R3, 0);
+  if (!vector_is_empty (entry_points))
+    jit_patch_at (site, vector_top (entry_points));
+  jit_pushargr (JIT_R3);
+  jit_pushargi ((jit_word_t) "compiled");
+  jit_pushargi (bytes);
+  jit_finishi (alloc_profile_sample);
+  for (int i = 0; i < 3; ++i)
+    jit_ldxi (saved[i], JIT_FP, stack_base + offsetof (struct stack_layout, live_values)
+	      + i * sizeof (jit_word_t));
+  jit_patch (skip);
+}
+
+/* Hand the free pointer in V3 back to the object stack, on which C
+   code may allocate as well. */
+static void
+store_free_pointer (jit_state_t *_jit)
+{
+  stack_load (JIT_R3, vm);
+  jit_stxi (offsetof (struct vm, heap.stack.free), JIT_R3, JIT_V3);
+}
+
+/* Load the free pointer of the object stack into V3 and cache its
+   limit. */
+static void
+load_free_pointer (jit_state_t *_jit)
+{
+  stack_load (JIT_R3, vm);
+  jit_ldxi (JIT_V3, JIT_R3, offsetof (struct vm, heap.stack.free));
+  jit_ldxi (JIT_R3, JIT_R3, offsetof (struct vm, heap.stack.limit));
+  stack_store (heap_limit, JIT_R3);
+}
+
 /* TODO(XXX): Reduce code size by using calli/ret. */
 DEFINE_INSTRUCTION(alloc)
 {
   /* FIXME(XXX): R3, V3 may not be available. */
   OPERAND (words, imm);
   size_t const bytes = words * WORDSIZE;
-  jit_extr_us (JIT_R3, JIT_V3);
-  jit_node_t *ok = jit_forward ();
-  jit_node_t *jump1 = jit_blei_u (JIT_R3, 0x10000 - bytes);
-  jit_patch_at (jump1, ok);
-  stack_load (JIT_R3, heap_end);
+  if (profiling)
+    count_allocation (_jit, entry_points, bytes);
+  /* The comparison is signed so that an object stack without chunks,
+     whose limit is NULL, is never taken to have room. */
+  stack_load (JIT_R3, heap_limit);
   jit_subi (JIT_R3, JIT_R3, bytes);
-  jit_node_t *jump2 = jit_bler_u (JIT_V3, JIT_R3);
-  jit_patch_at (jump2, ok);
+  jit_node_t *ok = jit_forward ();
+  jit_node_t *jump = jit_bler (JIT_V3, JIT_R3);
+  jit_patch_at (jump, ok);
 
-  /* We have to do a garbage collection. */
-  jit_prepare ();
-  stack_load (JIT_R3, vm);
-  jit_addi (JIT_R3, JIT_R3, offsetof (struct vm, heap));
-  jit_pushargr (JIT_R3);
+  /* The object stack makes room in a new chunk unless it is full.
+     Once it is, a collection is done first. */
+  store_free_pointer (_jit);
   Object regs = operands;
-  int i = 0;
-  for (int i = 0; !is_null (operands); ++i)
+  int count = 0;
+  for (; !is_null (operands); ++count)
     {
-      OPERAND (r0, ireg);      
+      OPERAND (r0, ireg);
       jit_stxi (stack_base + offsetof (struct stack_layout, live_values)
-		+ i * sizeof (jit_word_t), JIT_FP, r0);
+		+ count * sizeof (jit_word_t), JIT_FP, r0);
     }
+  jit_prepare ();
+  stack_load (JIT_R3, vm);
+  jit_addi (JIT_R3, JIT_R3, offsetof (struct vm, heap.stack));
+  jit_pushargr (JIT_R3);
+  jit_pushargi (words);
+  jit_finishi (object_stack_reserve);
+  jit_retval_uc (JIT_R3);
+  jit_node_t *reserved = jit_bnei (JIT_R3, 0);
+
+  jit_prepare ();
+  stack_load (JIT_R3, vm);
+  jit_addi (JIT_R3, JIT_R3, offsetof (struct vm, heap));
+  jit_pushargr (JIT_R3);
   jit_addi (JIT_R3, JIT_FP, stack_base + offsetof (struct stack_layout, live_values));
   jit_pushargr (JIT_R3);
-  jit_pushargi (i);
+  jit_pushargi (count);
   jit_finishi (collect);
+  jit_prepare ();
+  stack_load (JIT_R3, vm);
+  jit_addi (JIT_R3, JIT_R3, offsetof (struct vm, heap.stack));
+  jit_pushargr (JIT_R3);
+  jit_pushargi (words);
+  jit_finishi (object_stack_reserve);
+
+  jit_patch (reserved);
   operands = regs;
   for (int i = 0; !is_null (operands); ++i)
     {
-      OPERAND (r0, ireg);      
+      OPERAND (r0, ireg);
       jit_ldxi (r0, JIT_FP, stack_base + offsetof (struct stack_layout, live_values)
 		+ i * sizeof (jit_word_t));
     }
-
-  /* Reset free pointer. */
-  stack_load (JIT_V3, heap_base);
+  load_free_pointer (_jit);
 
   /* Everything done. */
   jit_link (ok);
 }
 
+/* Call FUNCTION with the heap and the object in R0.  The integer
+   registers that are not preserved across calls are saved. */
+static void
+call_heap_function (jit_state_t *_jit, jit_pointer_t function, jit_gpr_t r0)
+{
+  jit_gpr_t const saved[] = { JIT_R0, JIT_R1, JIT_R2 };
+  for (int i = 0; i < 3; ++i)
+    jit_stxi (stack_base + offsetof (struct stack_layout, live_values)
+	      + i * sizeof (jit_word_t), JIT_FP, saved[i]);
+  jit_prepare ();
+  stack_load (JIT_R3, vm);
+  jit_addi (JIT_R3, JIT_R3, offsetof (struct vm, heap));
+  jit_pushargr (JIT_R3);
+  jit_pushargr (r0);
+  jit_finishi (function);
+  for (int i = 0; i < 3; ++i)
+    jit_ldxi (saved[i], JIT_FP, stack_base + offsetof (struct stack_layout, live_values)
+	      + i * sizeof (jit_word_t));
+}
+
+/* Keep the object in a register in place until it is unpinned, so
+   that its contents can be passed to native code. */
+DEFINE_INSTRUCTION(pin)
+{
+  OPERAND (r0, ireg);
+  call_heap_function (_jit, pin, r0);
+}
+
+DEFINE_INSTRUCTION(unpin)
+{
+  OPERAND (r0, ireg);
+  call_heap_function (_jit, unpin, r0);
+}
+
+/* The called function may allocate on the object stack, so the free
+   pointer is handed over to it and taken back afterwards. */
+DEFINE_INSTRUCTION(finishr)
+{
+  OPERAND (r0, ireg);
+  store_free_pointer (_jit);
+  jit_finishr (r0);
+  load_free_pointer (_jit);
+}
+
+DEFINE_INSTRUCTION(finishi)
+{
+  OPERAND (fn, fun);
+  store_free_pointer (_jit);
+  if (fn.label == NULL)
+    jit_finishi ((jit_pointer_t) fn.value);
+  else
+    {
+      jit_node_t *addr = jit_finishi (NULL);
+      jit_patch_at (addr, fn.label->jit_label);
+    }
+  load_free_pointer (_jit);
+}
+
 DEFINE_INSTRUCTION(mov)
 {
   OPERAND (target, ireg);
@@ -732,14 +868,14 @@ instruction_table_lookup (InstructionTable *table, Object name)
   return instr->function;
 }
  
-int (*trampoline) (Vm *vm, void *f, void *heap, void *arg);
+int (*trampoline) (Vm *vm, void *f, void *arg);
 
 static jit_state_t *_jit;
 
 void
 init_compiler (void)
 {
-  jit_node_t *vm, *f, *heap, *arg;
+  jit_node_t *vm, *f, *arg;
   jit_node_t *done;
   
   jit_set_memory_functions (xmalloc, xrealloc, free);
@@ -751,18 +887,15 @@ init_compiler (void)
   jit_frame (FRAME_SIZE);
   vm = jit_arg ();
   f = jit_arg ();
-  heap = jit_arg ();
   arg = jit_arg ();
   jit_getarg (JIT_R0, vm);
   stack_store (vm, JIT_R0);  
-  jit_getarg (JIT_V3, heap);
-  stack_store (heap_base, JIT_V3);
-  jit_addi (JIT_R0, JIT_V3, 1ULL << 20); /* FIXME(XXX): Do not hardcode heap size. */
-  stack_store (heap_end, JIT_R0);
+  load_free_pointer (_jit);
   jit_getarg (JIT_R1, f);
   jit_getarg (JIT_R0, arg);
   jit_jmpr (JIT_R1);
   done = jit_indirect ();
+  store_free_pointer (_jit);
   jit_retr (JIT_R0);
   jit_epilog ();
   trampoline = jit_emit();
@@ -825,6 +958,7 @@ compile (Heap *heap, Object code)
   Resource(ASSEMBLY) *res = resource_manager_allocate (ASSEMBLY, &heap->resource_manager);
 
   assembly_clear (assembly);
+  profiling = heap->alloc_profile.interval != 0;
 
   LabelTable *labels = label_table_create ();
 
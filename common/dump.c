@@ -33,6 +33,7 @@
 #include "unistr.h"
 #include "unistdio.h"
 #include "vmcommon.h"
+#include "xalloc.h"
 #include "xmalloca.h"
 
 #define obstack_chunk_alloc xmalloc
@@ -94,6 +95,14 @@ dump_string (Object obj, FILE *out)
 {
   uint32_t *s = string_bytes (obj);
   size_t n = string_length (obj);
+  uint32_t *chars = NULL;
+  if (string_width (obj) != sizeof (uint32_t))
+    {
+      /* The characters of narrower strings are widened first. */
+      s = chars = XNMALLOC (n, uint32_t);
+      for (size_t i = 0; i < n; ++i)
+	chars[i] = string_ref (obj, i);
+    }
   if (u32_chr (s, n, 0x0a))
     {
       fputs ("(string ", out);
@@ -120,6 +129,7 @@ dump_string (Object obj, FILE *out)
 	  }
       fputc ('"', out);
     }
+  free (chars);
 }
 
 static void
@@ -20,67 +20,355 @@
 #ifdef HAVE_CONFIG_H
 # include <config.h>
 #endif
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#if defined __AVX2__
+# include <immintrin.h>
+#elif defined __SSE2__
+# include <emmintrin.h>
+#endif
 
+#include "gc.h"
+#include "minmax.h"
+#include "stack.h"
 #include "vmcommon.h"
 #include "xalloc.h"
 
-typedef bool (*MutationProcessor) (Object *, Heap *);
+/* Bounds of the nursery size in bytes, which is a multiple of
+   NURSERY_GRANULE. */
+#define NURSERY_MIN_SIZE (1ULL << 18)
+#define NURSERY_MAX_SIZE (1ULL << 26)
+#define NURSERY_GRANULE  0x10000
+
+/* The nursery is grown if less than this fraction of it survives a
+   minor collection. */
+#define NURSERY_LOW_SURVIVAL 0.1
+
+/* Minor collections should not happen more often than once in this
+   number of seconds. */
+#define NURSERY_MIN_INTERVAL 0.01
+
+/* Objects surviving this number of minor collections are promoted by
+   default.  The survivor space of the first age holds up to the
+   nursery size divided by SURVIVOR_RATIO. */
+#define TENURING_THRESHOLD 2
+#define SURVIVOR_RATIO     4
+
+/* Default pause target in seconds. */
+#define PAUSE_TARGET 0.01
+
+/* After a full collection, the tenured space is sized so that the
+   live data fill this fraction of it by default.  It is shrunk only
+   after this many full collections in a row would have shrunk it. */
+#define OCCUPANCY_TARGET 0.5
+#define SHRINK_DELAY     3
+
+/* Default budget of an incremental marking slice in seconds. */
+#define SLICE_BUDGET 0.001
+
+/* In depth-first order, the objects copied into the current block of
+   this number of words are scanned first. */
+#define SCAN_BLOCK_WORDS 128
+
+static void region_free (Heap *heap, RetainedRegion *region);
+
+static void
+card_table_init (CardTable *table, size_t heap_size)
+{
+  table->card_count = (heap_size + CARD_SIZE - 1) >> CARD_SHIFT;
+  table->cards = xzalloc (table->card_count);
+  table->objects = XNMALLOC (table->card_count, Pointer);
+}
+
+static void
+card_table_destroy (CardTable *table)
+{
+  free (table->cards);
+  free (table->objects);
+}
 
-static MutationTable *
-mutation_table_create ()
+void
+card_table_clear (CardTable *table)
+{
+  memset (table->cards, CARD_CLEAN, table->card_count);
+}
+
+static size_t
+card_index (Heap *heap, Pointer pointer)
+{
+  return ((char *) pointer - (char *) heap->start) >> CARD_SHIFT;
+}
+
+static void
+card_table_mark (Heap *heap, Pointer slot)
+{
+  heap->card_table.cards[card_index (heap, slot)] = CARD_DIRTY;
+}
+
+/* Record OBJECT of SIZE words as the object covering the first word
+   of each card whose start lies within it. */
+void
+card_table_record (Heap *heap, Pointer object, size_t size)
+{
+  size_t offset = object - heap->start;
+  size_t first = (offset + CARD_WORDS - 1) / CARD_WORDS;
+  size_t last = (offset + size - 1) / CARD_WORDS;
+  for (size_t i = first; i <= last; ++i)
+    heap->card_table.objects[i] = object;
+}
+
+/* Size in bytes of a tenured space for USED words of data: enough
+   for the data to fill the occupancy target plus the survivors of a
+   minor collection, but within the bounds of the heap size. */
+static size_t
+tenured_size (Heap *heap, size_t used)
+{
+  size_t size = used * WORDSIZE / heap->occupancy_target + heap->nursery_size;
+  return MIN (MAX (size, heap->min_heap_size), heap->heap_size);
+}
+
+/* Round SIZE up to the pages memory is committed and returned in. */
+static size_t
+page_round_up (Heap *heap, size_t size)
+{
+  size_t page = heap->huge_pages ? HUGE_PAGE_SIZE : (size_t) getpagesize ();
+  return (size + page - 1) & -page;
+}
+
+/* Size in bytes of the range of addresses of a tenured space.  The
+   ranges are aligned to huge pages. */
+static size_t
+space_size (Heap *heap)
+{
+  return (heap->heap_size + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE;
+}
+
+/* Reserve a range of SIZE bytes of addresses aligned to ALIGNMENT, a
+   multiple of the page size. */
+static Pointer
+reserve (size_t size, size_t alignment)
+{
+  char *range = mmap (NULL, size + alignment - getpagesize (), PROT_NONE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (range == MAP_FAILED)
+    xalloc_die ();
+  char *start = (char *) (((uintptr_t) range + alignment - 1) & -alignment);
+  if (start > range)
+    munmap (range, start - range);
+  munmap (start + size, range + alignment - getpagesize () - start);
+  return (Pointer) start;
+}
+
+/* Return a reserved range of addresses for a tenured space whose
+   first SIZE bytes are committed.  Their pages only become resident
+   when they are first written to. */
+static Pointer
+space_acquire (Heap *heap, size_t size)
 {
-  MutationTable *p = hash_initialize (0, NULL, NULL, NULL, NULL);
-  if (p == NULL)
+  Pointer space;
+  if (stack_is_empty (&heap->spaces))
+    space = reserve (space_size (heap), HUGE_PAGE_SIZE);
+  else
+    space = stack_pop (&heap->spaces);
+  if (mprotect (space, MIN (page_round_up (heap, size), space_size (heap)), PROT_READ | PROT_WRITE) != 0)
     xalloc_die ();
-  return p;
+#ifdef MADV_HUGEPAGE
+  if (heap->huge_pages)
+    madvise (space, space_size (heap), MADV_HUGEPAGE);
+#endif
+  return space;
 }
 
+/* Return the memory of the tenured space SPACE to the system but keep
+   its addresses reserved for a later one. */
 static void
-mutation_table_do_for_each (const MutationTable *table, MutationProcessor processor, void *data)
+space_release (Heap *heap, Pointer space)
 {
-  hash_do_for_each (table, (Hash_processor) processor, data);
+  madvise (space, space_size (heap), MADV_DONTNEED);
+  mprotect (space, space_size (heap), PROT_NONE);
+  stack_push (&heap->spaces, space);
 }
 
+/* Return the memory of the tenured space beyond the free pointer to
+   the system. */
 static void
-mutation_table_clear (MutationTable *table)
+space_trim (Heap *heap)
 {
-  hash_clear (table);
+  char *free = (char *) heap->start
+    + page_round_up (heap, (char *) heap->free - (char *) heap->start);
+  if (free < (char *) heap->end)
+    madvise (free, (char *) heap->end - free, MADV_DONTNEED);
 }
 
+/* Resize the tenured space in place to SIZE bytes, which have to hold
+   its data.  The memory it gains is committed, and the memory it
+   loses is returned to the system. */
 static void
-mutation_table_free (MutationTable *table)
+space_resize (Heap *heap, size_t size)
 {
-  hash_free (table);
+  char *start = (char *) heap->start;
+  size_t old = page_round_up (heap, (char *) heap->end - start);
+  size_t new = page_round_up (heap, size);
+  /* Huge pages may have been enabled after the space has been
+     committed in pages of the system. */
+  size_t page = getpagesize ();
+  size_t committed = ((char *) heap->end - start + page - 1) & -page;
+  if (new > committed)
+    {
+      if (mprotect (start + committed, new - committed, PROT_READ | PROT_WRITE) != 0)
+	xalloc_die ();
+    }
+  else if (new < old)
+    {
+      madvise (start + new, old - new, MADV_DONTNEED);
+      mprotect (start + new, old - new, PROT_NONE);
+    }
+  heap->end = heap->start + size / WORDSIZE;
 }
 
+/* Adapt the size of the tenured space, which was CURRENT bytes, to
+   the data left by a full collection.  It is grown at once but only
+   shrunk once its occupancy has stayed low. */
 static void
-mutation_table_insert (MutationTable *table, Pointer pointer)
+heap_resize (Heap *heap, size_t current)
 {
-  if (hash_insert (table, pointer) == NULL)
-    xalloc_die ();
+  size_t size = tenured_size (heap, heap->free - heap->start);
+  if (size >= current || ++heap->low_occupancy >= SHRINK_DELAY)
+    heap->low_occupancy = 0;
+  else
+    size = current;
+  space_resize (heap, size);
+}
+
+static bool
+overlaps (uintptr_t start, uintptr_t end, void *block, size_t size)
+{
+  return start < (uintptr_t) block + size && (uintptr_t) block < end;
+}
+
+/* Back the tenured space and the object stack by huge pages from now
+   on.  The current tenured space is advised at once; the object stack
+   gets chunks of huge pages from the next collection on. */
+void
+heap_use_huge_pages (Heap *heap)
+{
+  heap->huge_pages = true;
+  heap->stack.huge_pages = true;
+#ifdef MADV_HUGEPAGE
+  madvise (heap->start, space_size (heap), MADV_HUGEPAGE);
+#endif
+}
+
+/* Return the number of bytes of the tenured space and the object
+   stack that are backed by huge pages, as reported by the system.
+   The report is read at most once between two collections. */
+size_t
+heap_huge_page_bytes (Heap *heap)
+{
+  if (heap->huge_page_collection == heap->collections)
+    return heap->huge_page_bytes;
+  heap->huge_page_collection = heap->collections;
+  heap->huge_page_bytes = 0;
+  FILE *smaps = fopen ("/proc/self/smaps", "r");
+  if (smaps == NULL)
+    return 0;
+  size_t bytes = 0;
+  bool counted = false;
+  char line[512];
+  while (fgets (line, sizeof line, smaps) != NULL)
+    {
+      uintptr_t start, end;
+      size_t size;
+      if (sscanf (line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2)
+	counted = overlaps (start, end, heap->start, space_size (heap))
+	  || object_stack_overlaps (&heap->stack, start, end);
+      else if (counted && sscanf (line, "AnonHugePages: %zu kB", &size) == 1)
+	bytes += size * 1024;
+    }
+  fclose (smaps);
+  heap->huge_page_bytes = bytes;
+  return bytes;
 }
 
+/* Allocate a fresh tenured space for USED words of survivors. */
 static Pointer
-flip (Heap *restrict heap)
+flip (Heap *restrict heap, size_t used)
 {
-  Pointer old_start = heap->start;  
-  heap->free = heap->start = xaligned_alloc (2 * WORDSIZE, heap->heap_size);
+  Pointer old_start = heap->start;
+  size_t size = tenured_size (heap, used);
+  heap->free = heap->start = space_acquire (heap, size);
+  heap->end = heap->start + size / WORDSIZE;
+  /* The objects frozen in the old space have been copied. */
+  heap->frozen = heap->start;
+  card_table_clear (&heap->card_table);
   return old_start;
 }
 
+double
+current_time (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 void
 heap_init (Heap *heap, size_t heap_size)
 {
   heap->heap_size = heap_size;
-  /* TODO(XXX): Do not hardcode value.  Value depends on the size of the local heap. */
+  heap->min_heap_size = 0;
+  heap->occupancy_target = OCCUPANCY_TARGET;
+  heap->low_occupancy = 0;
+  heap->emergencies = 0;
+  heap->full = false;
+  heap->evacuating = false;
+  /* The initial size is adapted by nursery_resize. */
   heap->nursery_size = 1ULL << 20;
-  heap->mutation_table = mutation_table_create ();
+  heap->tenuring_threshold = TENURING_THRESHOLD;
+  for (size_t i = 0; i < TENURING_THRESHOLD_MAX; ++i)
+    heap->survivors[i] = heap->aged[i] = (SurvivorSpace) { NULL };
+  heap->pause_target = PAUSE_TARGET;
+  heap->mutator_start = current_time ();
+  heap->nursery_stats = (VmNurseryStats) { .size = heap->nursery_size,
+					   .min_size = heap->nursery_size,
+					   .max_size = heap->nursery_size };
+  heap->gc_threads = 1;
+  heap->compact = false;
+  heap->incremental = false;
+  heap->depth_first = true;
+  heap->huge_pages = false;
+  heap->huge_page_bytes = 0;
+  heap->huge_page_collection = SIZE_MAX;
+  heap->slice_budget = SLICE_BUDGET;
+  heap->compactor = NULL;
+  heap->collections = 0;
+  stack_init (&heap->ephemerons);
+  pthread_mutex_init (&heap->ephemeron_lock, NULL);
+  stack_init (&heap->guarded);
+  heap->guarded_young = 0;
+  stack_init (&heap->pinned);
+  stack_init (&heap->retained);
+  heap->unpinned = 0;
+  stack_init (&heap->spaces);
+  gc_telemetry_init (&heap->telemetry);
+  alloc_profile_init (&heap->alloc_profile);
+  heap->copied = 0;
+  card_table_init (&heap->card_table, heap_size);
+  large_object_space_init (&heap->large_object_space, heap_size);
+  heap->start = heap->free = NULL;
   symbol_table_init (&heap->symbol_table);
   resource_manager_init (&heap->resource_manager);
   object_stack_init (&heap->stack);
-  flip (heap);
+  object_stack_limit (&heap->stack, heap->nursery_size);
+  flip (heap, 0);
 #define EXPAND_SYMBOL(id, name)			\
   symbols[SYMBOL_##id] = make_symbol (heap, name, strlen (name));
 # include "symbols.def"
@@ -90,37 +378,309 @@ heap_init (Heap *heap, size_t heap_size)
 void
 heap_destroy (Heap *heap)
 {
+  stop_marking (heap);
+  gc_telemetry_destroy (&heap->telemetry);
+  alloc_profile_destroy (&heap->alloc_profile);
+  RetainedRegion *region;
+  STACK_FOREACH (&heap->retained, region)
+    region_free (heap, region);
+  stack_destroy (&heap->retained);
+  for (size_t i = 0; i < TENURING_THRESHOLD_MAX; ++i)
+    free (heap->survivors[i].start);
+  stack_destroy (&heap->pinned);
+  stack_destroy (&heap->guarded);
+  pthread_mutex_destroy (&heap->ephemeron_lock);
+  stack_destroy (&heap->ephemerons);
   object_stack_destroy (&heap->stack);
-  mutation_table_free (heap->mutation_table);
+  card_table_destroy (&heap->card_table);
+  large_object_space_destroy (&heap->large_object_space);
   symbol_table_destroy (&heap->symbol_table);
   resource_manager_destroy (&heap->resource_manager);
-  free (heap->start);
+  munmap (heap->start, space_size (heap));
+  Pointer *space;
+  STACK_FOREACH (&heap->spaces, space)
+    munmap (*space, space_size (heap));
+  stack_destroy (&heap->spaces);
+}
+
+/* Pinned objects are expected to be few, so they are looked up
+   linearly. */
+static Pin *
+pin_lookup (Heap *heap, Object object)
+{
+  Pin *pin;
+  STACK_FOREACH (&heap->pinned, pin)
+    if (pin->object == object)
+      return pin;
+  return NULL;
 }
 
 static bool
-is_in_heap (Heap *heap, Pointer object)
+is_pinned (Heap *heap, Pointer pointer)
+{
+  return !stack_is_empty (&heap->pinned) && pin_lookup (heap, (Object) pointer) != NULL;
+}
+
+/* Return true if a pinned object lies in REGION. */
+static bool
+holds_pinned (Heap *heap, RetainedRegion *region)
+{
+  Pin *pin;
+  STACK_FOREACH (&heap->pinned, pin)
+    {
+      Pointer pointer = (Pointer) pin->object;
+      if (region->start != NULL
+	  ? pointer >= region->start && pointer < region->end
+	  : object_stack_contains (&region->stack, pointer))
+	return true;
+    }
+  return false;
+}
+
+static void
+region_free (Heap *heap, RetainedRegion *region)
+{
+  if (region->start == NULL)
+    object_stack_destroy (&region->stack);
+  else if (region->tenured)
+    space_release (heap, region->start);
+  else
+    free (region->start);
+}
+
+/* Free REGION unless pinned objects lie in it. */
+static void
+release (Heap *heap, RetainedRegion region)
+{
+  if (holds_pinned (heap, &region))
+    stack_push (&heap->retained, region);
+  else
+    region_free (heap, &region);
+}
+
+/* Free the retained regions in which no pinned objects lie anymore.
+   The objects in them that have been unpinned have been moved out by
+   the collection that has just finished. */
+static void
+release_retained (Heap *heap)
+{
+  RetainedRegion *base = heap->retained.base;
+  ptrdiff_t kept = 0;
+  for (ptrdiff_t i = 0; i < stack_size (&heap->retained); ++i)
+    if (holds_pinned (heap, &base[i]))
+      base[kept++] = base[i];
+    else
+      region_free (heap, &base[i]);
+  heap->retained.items = kept;
+}
+
+/* Return true if the object at POINTER is kept where it has been
+   allocated while it is pinned, that is, outside the tenured space
+   and the memory of objects that are never moved. */
+bool
+is_kept_in_place (Heap *heap, Pointer pointer)
+{
+  return !is_in_heap (heap, pointer)
+    && !is_well_known_symbol (pointer)
+    && !large_object_space_contains (&heap->large_object_space, pointer)
+    && !is_unmanaged (pointer);
+}
+
+/* Record that SLOT may refer to an object outside the tenured
+   space. */
+void
+remember (Heap *heap, Pointer slot)
 {
-  return object >= heap->start && object < heap->free;
+  if (is_in_heap (heap, slot))
+    card_table_mark (heap, slot);
+  else if (large_object_space_contains (&heap->large_object_space, slot))
+    large_object_space_write (&heap->large_object_space, slot);
 }
 
 static size_t
 free_space (Heap *heap)
 {
-  return (heap->heap_size - (heap->free - heap->start));
+  return heap->end - heap->free;
+}
+
+/* Return the words the parallel workers may leave unused at the ends
+   of their copy buffers. */
+static size_t
+copy_slack (Heap *heap)
+{
+  return heap->gc_threads > 1 ? heap->gc_threads * PLAB_WORDS : 0;
+}
+
+/* Return the number of minor collections the object at POINTER has
+   survived without being promoted. */
+static size_t
+survivor_age (Heap *heap, Pointer pointer)
+{
+  for (size_t i = 1; i < heap->tenuring_threshold; ++i)
+    if (pointer >= heap->survivors[i].start && pointer < heap->survivors[i].free)
+      return i;
+  return 0;
+}
+
+bool
+is_survivor (Heap *heap, Pointer pointer)
+{
+  for (size_t i = 1; i < TENURING_THRESHOLD_MAX; ++i)
+    if (pointer >= heap->survivors[i].start && pointer < heap->survivors[i].free)
+      return true;
+  return false;
+}
+
+/* Return true if the object at POINTER has been copied into a survivor
+   space by the current collection. */
+static bool
+is_aged (Heap *heap, Pointer pointer)
+{
+  for (size_t i = 1; i < heap->tenuring_threshold; ++i)
+    if (pointer >= heap->aged[i].start && pointer < heap->aged[i].end)
+      return true;
+  return false;
+}
+
+/* Return the number of words kept in the survivor spaces. */
+size_t
+survivor_words (Heap *heap)
+{
+  size_t words = 0;
+  for (size_t i = 1; i < TENURING_THRESHOLD_MAX; ++i)
+    words += heap->survivors[i].free - heap->survivors[i].start;
+  return words;
+}
+
+/* Allocate the survivor spaces for a minor collection.  Those of an
+   age above the first one can take all objects one age younger.
+   While the nursery is evacuated, the first one can take the whole
+   nursery and the oldest one its own objects as well. */
+static void
+survivors_begin (Heap *heap)
+{
+  size_t oldest = heap->tenuring_threshold - 1;
+  for (size_t i = 1; i < heap->tenuring_threshold; ++i)
+    {
+      size_t size = i == 1
+	? heap->nursery_size / SURVIVOR_RATIO / WORDSIZE & -(size_t) GRANULE_WORDS
+	: (size_t) (heap->survivors[i - 1].free - heap->survivors[i - 1].start);
+      if (heap->evacuating && i == 1)
+	size = object_stack_size (&heap->stack) / WORDSIZE + heap->unpinned;
+      if (heap->evacuating && i == oldest)
+	size += heap->survivors[i].free - heap->survivors[i].start;
+      if (size == 0)
+	continue;
+      SurvivorSpace *space = &heap->aged[i];
+      space->start = space->scan = space->free = xaligned_alloc (ALIGNMENT, size * WORDSIZE);
+      space->end = space->start + size;
+    }
+}
+
+/* Make the objects copied into survivor spaces by the collection that
+   has just finished the survivors, and release the former ones unless
+   pinned objects lie in them. */
+static void
+survivors_end (Heap *heap)
+{
+  for (size_t i = 1; i < TENURING_THRESHOLD_MAX; ++i)
+    {
+      SurvivorSpace *space = &heap->survivors[i];
+      if (space->start != NULL)
+	release (heap, (RetainedRegion) { .start = space->start, .end = space->end });
+      *space = heap->aged[i];
+      heap->aged[i] = (SurvivorSpace) { NULL };
+      if (space->free == space->start)
+	{
+	  free (space->start);
+	  *space = (SurvivorSpace) { NULL };
+	}
+    }
+}
+
+/* Allocate SIZE words for the copy of the object at FROM, which is
+   not a symbol, in the survivor space of its next age.  Return NULL if
+   the object is promoted instead.  While the nursery is evacuated, the
+   oldest objects stay in the oldest survivor space. */
+Pointer
+survivor_allocate (Heap *heap, Worker *worker, Pointer from, size_t size)
+{
+  size_t age = survivor_age (heap, from) + 1;
+  if (heap->evacuating)
+    age = MIN (age, heap->tenuring_threshold - 1);
+  if (age >= heap->tenuring_threshold || heap->aged[age].start == NULL)
+    return NULL;
+
+  SurvivorSpace *space = &heap->aged[age];
+  if (worker == NULL)
+    {
+      if (space->end - space->free >= (ptrdiff_t) size)
+	{
+	  Pointer to = space->free;
+	  space->free += size;
+	  return to;
+	}
+    }
+  else
+    {
+      Pointer free = __atomic_load_n (&space->free, __ATOMIC_RELAXED);
+      while (space->end - free >= (ptrdiff_t) size)
+	if (__atomic_compare_exchange_n (&space->free, &free, free + size, true,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	  return free;
+    }
+
+  /* The object is promoted prematurely. */
+  __atomic_add_fetch (&heap->nursery_stats.premature, size * WORDSIZE, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* Large objects other than symbols, which have to be interned, are
+   moved into the large object space when they are promoted, and are
+   never copied again. */
+bool
+is_large (Object header, size_t size)
+{
+  return size * WORDSIZE >= LARGE_OBJECT_SIZE && (header & HEADER_TYPE_MASK) != SYMBOL_TYPE;
 }
 
 static Pointer
-copy (Heap *heap, Pointer from)
+copy_large (Heap *heap, Pointer from, size_t size)
+{
+  LargeObjectSpace *space = &heap->large_object_space;
+  Pointer to = large_object_space_allocate (space, size);
+  memcpy (to, from, size * WORDSIZE);
+  large_object_space_mark (space, to);
+  stack_push (&space->grey, to);
+  *from = make_mark (to);
+  return to;
+}
+
+static Pointer
+copy_one (Heap *heap, Pointer from)
 {
-  Pointer to = heap->free;
   size_t size = object_size (from);
+  heap->copied += size;
+  if (is_large (*from, size))
+    return copy_large (heap, from, size);
+  bool symbol = (*from & HEADER_TYPE_MASK) == SYMBOL_TYPE;
+  Pointer to = symbol ? NULL : survivor_allocate (heap, NULL, from, size);
+  if (to != NULL)
+    {
+      memcpy (to, from, size * WORDSIZE);
+      *from = make_mark (to);
+      return to;
+    }
+
+  to = heap->free;
   if (size > free_space (heap))
     xalloc_die ();
   heap->free += size;
   
   memcpy (to, from, size * WORDSIZE);
+  card_table_record (heap, to, size);
   
-  if ((*to & HEADER_TYPE_MASK) == SYMBOL_TYPE)
+  if (symbol)
     to = (Pointer) symbol_table_intern (&heap->symbol_table, (Object) (to + 1), true) - 1;
   
   *from = make_mark (to);
@@ -128,100 +688,937 @@ copy (Heap *heap, Pointer from)
   return to;
 }
 
+/* In depth-first order, the spine of a list is copied along with its
+   first pair so that list traversals find the pairs contiguous. */
+static Pointer
+copy (Heap *heap, Pointer from)
+{
+  Pointer to = copy_one (heap, from);
+  if (!heap->depth_first || (*to & OBJECT_TYPE_MASK) == HEADER_TYPE)
+    return to;
+
+  for (Pointer pair = to; ; )
+    {
+      Object next = pair[1];
+      if (!is_pair (next) || is_in_heap (heap, (Pointer) next)
+	  || is_aged (heap, (Pointer) next) || is_pinned (heap, (Pointer) next))
+	break;
+      Pointer forwarded = forwarding_address (*(Pointer) next);
+      if (forwarded != NULL)
+	{
+	  pair[1] = (Object) forwarded;
+	  break;
+	}
+      Pointer copied = copy_one (heap, (Pointer) next);
+      pair[1] = (Object) copied;
+      pair = copied;
+    }
+  return to;
+}
+
+/* Reserve between MIN and *SIZE words at the end of the heap.  On
+   return, *SIZE holds the number of words reserved. */
+Pointer
+heap_reserve (Heap *heap, size_t min, size_t *size)
+{
+  Pointer end = heap->end;
+  Pointer free = __atomic_load_n (&heap->free, __ATOMIC_RELAXED);
+  do
+    {
+      if (end - free < (ptrdiff_t) min)
+	xalloc_die ();
+      *size = MIN (*size, (size_t) (end - free));
+    }
+  while (!__atomic_compare_exchange_n (&heap->free, &free, free + *size, true,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return free;
+}
+
+/* Turn SIZE words at START into an object without pointers so that
+   the heap stays walkable. */
+void
+fill (Heap *heap, Pointer start, size_t size)
+{
+  if (size == 0)
+    return;
+  start[0] = BYTEVECTOR_TYPE;
+  start[1] = (size - 2) * WORDSIZE;
+  if (is_in_heap (heap, start))
+    card_table_record (heap, start, size);
+}
+
 static Pointer 
-forward (Heap *heap, Pointer from)
+forward (Heap *heap, Worker *worker, Pointer from)
 {
   Pointer from_header = object_header (from);
   Pointer to_header = forwarding_address (*from_header);
   if (to_header == NULL)
-    to_header = copy (heap, from_header);
+    {
+      if (is_pinned (heap, from))
+	return from;
+      to_header = worker == NULL ? copy (heap, from_header) : copy_parallel (worker, from_header);
+    }
   return to_header - (from_header - from);
 }
 
-static void
-process (Heap *heap, Object *object)
+/* Mark the object at POINTER if it is a large object or a resource,
+   neither of which is ever moved, and return true in this case.  A
+   large object marked for the first time is returned in *GREY to be
+   scanned. */
+static bool
+mark_in_place (Heap *heap, Pointer pointer, Pointer *grey)
 {
-  if (!is_pointer (*object)
-      || is_well_known_symbol ((Pointer) *object)
-      || is_in_heap (heap, (Pointer) *object))
-    return;
+  *grey = NULL;
+
+  LargeObjectSpace *space = &heap->large_object_space;
+  if (large_object_space_contains (space, pointer))
+    {
+      Pointer header = object_header (pointer);
+      if (large_object_space_mark (space, header))
+	*grey = header;
+      return true;
+    }
   
-  if (is_unmanaged ((Pointer) *object))
+  if (is_unmanaged (pointer))
     {
-      switch (header_type ((Pointer) *object))
+      switch (header_type (pointer))
 	{
 #define ENTRY(id, type, init, destroy)					\
 	  case TYPE(id):						\
 	    resource_manager_mark (id,					\
 				   &heap->resource_manager,		\
-				   (Resource(id) *) ((Pointer) *object - 1)); \
-	    return;
+				   (Resource(id) *) (pointer - 1));	\
+	    return true;
 	  RESOURCES
 #undef ENTRY
 	}
     }
 
-  *object = (Object) forward (heap, (Pointer) *object);
+  return false;
 }
 
+static void
+process (Heap *heap, Worker *worker, Object *object)
+{
+  if (!is_pointer (*object)
+      || is_well_known_symbol ((Pointer) *object)
+      || is_in_heap (heap, (Pointer) *object))
+    return;
+
+  /* The field may have been updated when a list was copied. */
+  if (is_aged (heap, (Pointer) *object))
+    {
+      remember (heap, object);
+      return;
+    }
+
+  Pointer grey;
+  if (mark_in_place (heap, (Pointer) *object, &grey))
+    {
+      if (grey == NULL)
+	return;
+      if (worker == NULL)
+	stack_push (&heap->large_object_space.grey, grey);
+      else
+	grey_push (&worker->grey, grey, grey + object_size (grey));
+      return;
+    }
+
+  Pointer from = (Pointer) *object;
+  Pointer to = forward (heap, worker, from);
+  /* A survivor or a pinned object stays outside the tenured space, so
+     the field has to be updated again once it is moved. */
+  if (!is_in_heap (heap, to))
+    remember (heap, object);
+  *object = (Object) to;
+}
+
+/* Return true if KEY, the key of an ephemeron, is known to be live
+   in this collection.  Keys that are resources are always live. */
+static bool
+is_key_live (Heap *heap, Object key)
+{
+  if (!is_pointer (key)
+      || is_well_known_symbol ((Pointer) key)
+      || is_in_heap (heap, (Pointer) key)
+      || is_aged (heap, (Pointer) key))
+    return true;
+
+  LargeObjectSpace *space = &heap->large_object_space;
+  if (large_object_space_contains (space, (Pointer) key))
+    return large_object_space_is_marked (space, (Pointer) key);
+
+  if (is_unmanaged ((Pointer) key) || is_pinned (heap, (Pointer) key))
+    return true;
+
+  Pointer header = object_header ((Pointer) key);
+  return forwarding_address (__atomic_load_n (header, __ATOMIC_ACQUIRE)) != NULL;
+}
+
+/* Queue the ephemeron at REF until its key is found live. */
+static void
+defer_ephemeron (Heap *heap, Worker *worker, Pointer ref)
+{
+  if (worker != NULL)
+    pthread_mutex_lock (&heap->ephemeron_lock);
+  stack_push (&heap->ephemerons, ref);
+  if (worker != NULL)
+    pthread_mutex_unlock (&heap->ephemeron_lock);
+}
+
+/* Scan the fields of the ephemeron at REF that lie between LOWER and
+   UPPER.  The value is only scanned if the key is live.  Otherwise,
+   the ephemeron is queued when its key field is scanned; as the
+   fields of a card are scanned in order, the value is never scanned
+   on its own before. */
+static void
+scan_ephemeron (Heap *heap, Worker *worker, Pointer ref, Pointer lower, Pointer upper)
+{
+  Pointer key = ref + 1;
+  Pointer value = ref + 2;
+  bool live = is_key_live (heap, *key);
+  if (key >= lower && key < upper)
+    {
+      if (!live)
+	{
+	  defer_ephemeron (heap, worker, ref);
+	  return;
+	}
+      process (heap, worker, key);
+    }
+  if (live && value >= lower && value < upper)
+    process (heap, worker, value);
+}
+
+/* Scan the values of the queued ephemerons whose keys have been found
+   live since.  Return true if there were any. */
 static bool
-processor (Object *object, Heap *heap)
+resolve_ephemerons (Heap *heap, Worker *worker)
 {
-  process (heap, object);
+  bool resolved = false;
+  for (ptrdiff_t i = 0; i < stack_size (&heap->ephemerons); )
+    {
+      Pointer ref = heap->ephemerons.base[i];
+      if (!is_key_live (heap, ref[1]))
+	{
+	  ++i;
+	  continue;
+	}
+      heap->ephemerons.base[i] = stack_pop (&heap->ephemerons);
+      process (heap, worker, ref + 1);
+      process (heap, worker, ref + 2);
+      resolved = true;
+    }
+  return resolved;
+}
+
+/* Break the ephemerons whose keys have turned out to be dead. */
+static void
+break_ephemerons (Heap *heap)
+{
+  while (!stack_is_empty (&heap->ephemerons))
+    {
+      Pointer ref = stack_pop (&heap->ephemerons);
+      ref[1] = ref[2] = make_undefined ();
+    }
+}
+
+/* Return true if the resource at POINTER has been marked in this
+   collection or is old during a minor one. */
+static bool
+is_resource_marked (Pointer pointer)
+{
+  switch (header_type (pointer))
+    {
+#define ENTRY(id, type, init, destroy)					\
+    case TYPE(id):							\
+      return !((Resource(id) *) (pointer - 1))->in_nursery;
+      RESOURCES
+#undef ENTRY
+    }
   return true;
 }
 
+/* Return true if OBJECT, which is registered with a guardian, is
+   known to be live in this collection.  Unlike ephemeron keys,
+   resources are only live if they have been marked. */
+static bool
+is_guarded_live (Heap *heap, Object object)
+{
+  if (is_resource (object))
+    return is_resource_marked ((Pointer) object);
+  return is_key_live (heap, object);
+}
+
+/* Drop the registrations with dead guardians among those subject to
+   this collection and order the rest so that the ones of dead objects
+   come last, starting at the returned index.  The registrations are
+   retained, and so are the dead objects. */
+static ptrdiff_t
+guard (Heap *heap, Worker *worker, bool major)
+{
+  Object *base = heap->guarded.base;
+  ptrdiff_t kept = major ? 0 : heap->guarded_young;
+  for (ptrdiff_t i = kept; i < stack_size (&heap->guarded); ++i)
+    if (is_key_live (heap, ((Pointer) base[i])[1]))
+      base[kept++] = base[i];
+  heap->guarded.items = kept;
+
+  ptrdiff_t ready = kept;
+  for (ptrdiff_t i = major ? 0 : heap->guarded_young; i < ready; )
+    if (is_guarded_live (heap, ((Pointer) base[i])[0]))
+      ++i;
+    else
+      {
+	Object entry = base[i];
+	base[i] = base[--ready];
+	base[ready] = entry;
+      }
+
+  for (ptrdiff_t i = major ? 0 : heap->guarded_young; i < kept; ++i)
+    process (heap, worker, &base[i]);
+  return ready;
+}
+
+/* Return the index of the first registration with a guardian that
+   has not been promoted.  Minor collections need not consider those
+   before. */
+ptrdiff_t
+first_young_guarded (Heap *heap)
+{
+  ptrdiff_t i = 0;
+  while (i < stack_size (&heap->guarded)
+	 && is_in_heap (heap, (Pointer) heap->guarded.base[i]))
+    ++i;
+  return i;
+}
+
+/* Queue the registrations from READY on in their guardians. */
+void
+queue_guarded (Heap *heap, ptrdiff_t ready)
+{
+  while (stack_size (&heap->guarded) > ready)
+    {
+      Pointer entry = (Pointer) stack_pop (&heap->guarded);
+      Pointer guardian = (Pointer) entry[1];
+      /* The guardian may have been traced by an incremental marking,
+	 and it may be older than the entry. */
+      mutate (heap, &entry[1], guardian[0]);
+      mutate (heap, &guardian[0], (Object) entry);
+    }
+}
+
+/* The number of fields whose tags are tested at once when scanning
+   an object. */
+#define SCAN_WORDS 8
+
+/* Return a mask whose bit I is set if the field P[I] of the next
+   SCAN_WORDS fields is not an immediate. */
+static unsigned
+reference_mask (Pointer p)
+{
+  unsigned mask = 0;
+#if defined __AVX2__ && __SIZEOF_POINTER__ == 8
+  __m256i const tag = _mm256_set1_epi64x (OBJECT_TYPE_MASK);
+  __m256i const immediate = _mm256_set1_epi64x (IMMEDIATE_TYPE);
+  for (int i = 0; i < SCAN_WORDS; i += 4)
+    {
+      __m256i words = _mm256_loadu_si256 ((__m256i const *) (p + i));
+      __m256i matches = _mm256_cmpeq_epi64 (_mm256_and_si256 (words, tag), immediate);
+      mask |= (unsigned) _mm256_movemask_pd (_mm256_castsi256_pd (matches)) << i;
+    }
+#elif defined __SSE2__ && __SIZEOF_POINTER__ == 8
+  /* The tag of a word lies in its lower half. */
+  __m128i const tag = _mm_set1_epi32 (OBJECT_TYPE_MASK);
+  __m128i const immediate = _mm_set1_epi32 (IMMEDIATE_TYPE);
+  for (int i = 0; i < SCAN_WORDS; i += 4)
+    {
+      __m128 low = _mm_castsi128_ps (_mm_loadu_si128 ((__m128i const *) (p + i)));
+      __m128 high = _mm_castsi128_ps (_mm_loadu_si128 ((__m128i const *) (p + i + 2)));
+      __m128i words = _mm_castps_si128 (_mm_shuffle_ps (low, high, _MM_SHUFFLE (2, 0, 2, 0)));
+      __m128i matches = _mm_cmpeq_epi32 (_mm_and_si128 (words, tag), immediate);
+      mask |= (unsigned) _mm_movemask_ps (_mm_castsi128_ps (matches)) << i;
+    }
+#else
+  for (int i = 0; i < SCAN_WORDS; ++i)
+    mask |= (unsigned) is_immediate (p[i]) << i;
+#endif
+  return ~mask & ((1U << SCAN_WORDS) - 1);
+}
+
+/* Prefetch the headers of the objects outside the tenured space that
+   are referred to by the fields P[I] for the bits I set in MASK. */
 static void
-scan (Heap *heap, Pointer ref)
+prefetch_referents (Heap *heap, Pointer p, unsigned mask)
 {
+  for (; mask != 0; mask &= mask - 1)
+    {
+      Pointer object = (Pointer) p[__builtin_ctz (mask)];
+      if (!is_in_heap (heap, object))
+	__builtin_prefetch ((void *) ((Object) object & ~(Object) OBJECT_TYPE_MASK), 1);
+    }
+}
+
+/* Process the fields P[I] for the bits I set in MASK. */
+static void
+process_references (Heap *heap, Worker *worker, Pointer p, unsigned mask)
+{
+  for (; mask != 0; mask &= mask - 1)
+    process (heap, worker, p + __builtin_ctz (mask));
+}
+
+/* Process the fields from P to END in groups, of which there are at
+   least two.  While a group is processed, the referents of the next
+   group are prefetched.  This is kept out of scan_range so that the
+   loop for short objects like pairs stays as tight as it was. */
+static void __attribute__ ((noinline))
+scan_groups (Heap *heap, Worker *worker, Pointer p, Pointer end)
+{
+  unsigned mask = reference_mask (p);
+  prefetch_referents (heap, p, mask);
+  for (; end - p >= 2 * SCAN_WORDS; p += SCAN_WORDS)
+    {
+      unsigned next = reference_mask (p + SCAN_WORDS);
+      prefetch_referents (heap, p + SCAN_WORDS, next);
+      process_references (heap, worker, p, mask);
+      mask = next;
+    }
+  process_references (heap, worker, p, mask);
+  for (p += SCAN_WORDS; p < end; ++p)
+    process (heap, worker, p);
+}
+
+/* Scan the pointer fields of the object at REF that lie between LOWER
+   and UPPER. */
+static void
+scan_range (Heap *heap, Worker *worker, Pointer ref, Pointer lower, Pointer upper)
+{
+  if (is_ephemeron_header (*ref))
+    {
+      scan_ephemeron (heap, worker, ref, lower, upper);
+      return;
+    }
+
   Pointer start = object_pointers (ref);
   /* Check for a binary object without any pointers. */
   if (start == NULL)
     return;
   
   size_t size = object_size (ref);
-  Pointer end = ref + size;
+  Pointer end = MIN (ref + size, upper);
+  Pointer p = MAX (start, lower);
+  if (__builtin_expect (end - p >= 2 * SCAN_WORDS, 0))
+    {
+      scan_groups (heap, worker, p, end);
+      return;
+    }
 
-  for (Pointer p = start; p < end; ++p)
-    process (heap, p);
+  for (; p < end; ++p)
+    process (heap, worker, p);
 }
 
 void
-collect (Heap *restrict heap, Object roots[], size_t root_count)
+scan (Heap *heap, Worker *worker, Pointer ref)
 {
-  /* FIXME(XXX): We have to add the obstack space to the nursery_size. */
-  Pointer old_start = (free_space (heap) < heap->nursery_size / WORDSIZE) ? flip (heap) : NULL;
-  Pointer ref = heap->start;
+  scan_range (heap, worker, ref, ref, ref + object_size (ref));
+}
+
+/* Scan the next object copied into a survivor space during a serial
+   collection.  Return false if there is none. */
+static bool
+scan_survivors (Heap *heap)
+{
+  for (size_t i = 1; i < heap->tenuring_threshold; ++i)
+    {
+      SurvivorSpace *space = &heap->aged[i];
+      if (space->scan < space->free)
+	{
+	  Pointer ref = space->scan;
+	  space->scan += object_size (ref);
+	  scan (heap, NULL, ref);
+	  return true;
+	}
+    }
+  return false;
+}
+
+/* Scan the dirty cards below LIMIT and clean them.  Return their
+   number. */
+static size_t
+scan_cards (Heap *heap, Worker *worker, Pointer limit)
+{
+  CardTable *table = &heap->card_table;
+  if (limit == heap->start)
+    return 0;
+
+  size_t count = card_index (heap, limit - 1) + 1;
+  size_t dirty = 0;
+  for (size_t i = 0; i < count; ++i)
+    {
+      if (table->cards[i] == CARD_CLEAN)
+	continue;
+      table->cards[i] = CARD_CLEAN;
+      ++dirty;
+
+      Pointer card_start = heap->start + i * CARD_WORDS;
+      Pointer card_end = MIN (card_start + CARD_WORDS, limit);
+      for (Pointer ref = table->objects[i]; ref < card_end; ref += object_size (ref))
+	scan_range (heap, worker, ref, card_start, card_end);
+    }
+  return dirty;
+}
+
+/* Scan the dirty pages of old large objects and clean them.  Return
+   their number. */
+static size_t
+scan_large_objects (Heap *heap, Worker *worker)
+{
+  LargeObjectSpace *space = &heap->large_object_space;
+  size_t dirty = 0;
+  for (LargeObject *object = deque_first (&space->heap_list);
+       object != NULL;
+       object = object->deque_entries.next)
+    {
+      Pointer ref = large_object_start (object);
+      size_t first = ((char *) object - space->base) >> LARGE_PAGE_SHIFT;
+      for (size_t i = 0; i < object->page_count; ++i)
+	{
+	  if (space->cards[first + i] == CARD_CLEAN)
+	    continue;
+	  space->cards[first + i] = CARD_CLEAN;
+	  ++dirty;
+
+	  Pointer page = (Pointer) ((char *) object + (i << LARGE_PAGE_SHIFT));
+	  scan_range (heap, worker, ref, page, page + LARGE_PAGE_SIZE / WORDSIZE);
+	}
+    }
+  return dirty;
+}
+
+/* Return true if REF lies in the block of the last word below FREE. */
+static bool
+is_in_scan_block (Pointer ref, Pointer free)
+{
+  return (((uintptr_t) ref ^ (uintptr_t) (free - 1))
+	  < SCAN_BLOCK_WORDS * WORDSIZE);
+}
+
+/* Scan the objects copied from REF on in approximately depth-first
+   order: the secondary scan pointer follows the objects copied into
+   the block holding the free pointer, so that the descendants of an
+   object are copied close to it.  When the free pointer leaves the
+   block, the secondary pointer skips to the first object starting in
+   the new one and the range it has scanned is queued so that REF,
+   which scans the remaining objects in copying order, passes over
+   it. */
+static Pointer
+trace_depth_first (Heap *heap, Pointer ref)
+{
+  LargeObjectSpace *space = &heap->large_object_space;
+  STACK(GreyRange) scanned;
+  stack_init (&scanned);
+  ptrdiff_t head = 0;
+  Pointer first = ref, secondary = ref;
+  for (;;)
+    {
+      if (secondary < heap->free)
+	{
+	  if (is_in_scan_block (secondary, heap->free))
+	    {
+	      scan (heap, NULL, secondary);
+	      secondary += object_size (secondary);
+	      continue;
+	    }
+	  Pointer block
+	    = (Pointer) ((uintptr_t) (heap->free - 1)
+			 & ~(uintptr_t) (SCAN_BLOCK_WORDS * WORDSIZE - 1));
+	  Pointer next = secondary;
+	  while (next < block)
+	    next += object_size (next);
+	  if (first < secondary)
+	    stack_push (&scanned, ((GreyRange) { first, secondary }));
+	  first = secondary = next;
+	}
+      else if (ref < heap->free)
+	{
+	  if (head < stack_size (&scanned) && ref == scanned.base[head].start)
+	    ref = scanned.base[head++].end;
+	  else if (ref == first)
+	    ref = secondary;
+	  else
+	    {
+	      scan (heap, NULL, ref);
+	      ref += object_size (ref);
+	    }
+	}
+      else if (!stack_is_empty (&space->grey))
+	scan (heap, NULL, stack_pop (&space->grey));
+      else if (!scan_survivors (heap) && !resolve_ephemerons (heap, NULL))
+	break;
+    }
+  stack_destroy (&scanned);
+  return ref;
+}
+
+/* Scan the objects copied from REF on, or let the workers do so, until
+   no more objects are found.  Scanning the values of ephemerons whose
+   keys have been found live may find more keys live.  Return the
+   position up to which the objects have been scanned. */
+static Pointer
+trace (Heap *heap, WorkerPool *pool, Worker *worker, Pointer ref)
+{
+  LargeObjectSpace *space = &heap->large_object_space;
+  if (worker == NULL && heap->depth_first)
+    return trace_depth_first (heap, ref);
+  if (worker == NULL)
+    for (;;)
+      {
+	if (ref < heap->free)
+	  {
+	    scan (heap, NULL, ref);
+	    ref += object_size (ref);
+	  }
+	else if (!stack_is_empty (&space->grey))
+	  scan (heap, NULL, stack_pop (&space->grey));
+	else if (!scan_survivors (heap) && !resolve_ephemerons (heap, NULL))
+	  return ref;
+      }
+
+  do
+    worker_pool_run (pool);
+  while (resolve_ephemerons (heap, worker));
+  return ref;
+}
+
+/* Process the pinned objects as roots.  Those that are kept in place
+   are scanned there. */
+static void
+scan_pinned (Heap *heap, Worker *worker)
+{
+  Pin *pin;
+  STACK_FOREACH (&heap->pinned, pin)
+    {
+      Object object = pin->object;
+      process (heap, worker, &object);
+      if (is_kept_in_place (heap, (Pointer) object))
+	scan (heap, worker, object_header ((Pointer) object));
+    }
+}
+
+/* Copy the objects reachable from ROOTS that are not yet in the
+   tenured space into it.  If OLD_START is not NULL, the tenured space
+   has just been flipped and the old one between OLD_START and OLD_END
+   is freed afterwards unless pinned objects lie in it.  Return the
+   number of dirty cards scanned. */
+static size_t
+collect_generation (Heap *heap, Object roots[], size_t root_count,
+		    Pointer old_start, Pointer old_end)
+{
+  bool major = old_start != NULL;
+  size_t dirty = 0;
+  /* Objects below the free pointer are already in the heap; only
+     those copied during this collection have to be scanned. */
+  Pointer ref = heap->free;
+
+  WorkerPool pool;
+  Worker *worker = NULL;
+  if (heap->gc_threads > 1)
+    {
+      worker_pool_init (&pool, heap, heap->gc_threads);
+      worker = &pool.workers[0];
+    }
   
-  resource_manager_begin_gc (&heap->resource_manager, old_start != NULL);
+  resource_manager_begin_gc (&heap->resource_manager, major);
+  large_object_space_begin_gc (&heap->large_object_space, major);
 
-  if (old_start == NULL)
-    mutation_table_do_for_each (heap->mutation_table, processor, heap);
-  mutation_table_clear (heap->mutation_table);
+  if (!major)
+    {
+      survivors_begin (heap);
+      dirty += scan_cards (heap, worker, ref);
+      dirty += scan_large_objects (heap, worker);
+    }
 
-  symbol_table_clear (&heap->symbol_table, old_start != NULL);
+  symbol_table_clear (&heap->symbol_table, major);
   
   for (size_t i = 0; i < SYMBOL_COUNT; ++i)
-    process (heap, &symbols[i]);
+    process (heap, worker, &symbols[i]);
 
   for (size_t i = 0; i < root_count; ++i)
-    process (heap, &roots [i]);
-  
-  for (; ref < heap->free; ref += object_size (ref))
-    scan (heap, ref);
-  
-  if (old_start != NULL)
-    free (old_start);
+    process (heap, worker, &roots [i]);
+
+  scan_pinned (heap, worker);
 
-  object_stack_clear (&heap->stack);
+  ref = trace (heap, &pool, worker, ref);
+  /* The objects retained for guardians are traced before the
+     ephemerons are broken. */
+  ptrdiff_t ready = guard (heap, worker, major);
+  trace (heap, &pool, worker, ref);
+  if (worker != NULL)
+    worker_pool_destroy (&pool);
+  break_ephemerons (heap);
+  queue_guarded (heap, ready);
+  survivors_end (heap);
+  heap->guarded_young = first_young_guarded (heap);
+  
+  if (major)
+    {
+      release (heap, (RetainedRegion) { .start = old_start, .end = old_end,
+					 .tenured = true });
+      /* The next major collection is due when the live data has
+	 about doubled. */
+      heap->end = MIN (heap->end,
+		       heap->start + tenured_size (heap, heap->free - heap->start) / WORDSIZE);
+    }
 
+  large_object_space_end_gc (&heap->large_object_space, major);
   resource_manager_end_gc (&heap->resource_manager);
+  return dirty;
+}
+
+/* Collect the tenured space, which the nursery has been evacuated
+   from, and resize it.  An incremental marking in progress is
+   completed.  With compaction, no second space is needed.  Return the
+   kind of the collection. */
+static VmGcKind
+collect_tenured (Heap *heap, Object roots[], size_t root_count)
+{
+  size_t current = (heap->end - heap->start) * WORDSIZE;
+  if (heap->compactor == NULL && (heap->compact || heap->frozen > heap->start))
+    heap->compactor = compactor_start (heap, roots, root_count);
+  if (heap->compactor != NULL)
+    {
+      compactor_drain (heap->compactor, INFINITY);
+      compactor_finish (heap->compactor, roots, root_count);
+      heap->compactor = NULL;
+      heap_resize (heap, current);
+      space_trim (heap);
+      return VM_GC_COMPACT;
+    }
+  Pointer old_end = heap->end;
+  collect_generation (heap, roots, root_count,
+		      flip (heap, (heap->free - heap->start) + survivor_words (heap)
+			    + copy_slack (heap)),
+		      old_end);
+  heap_resize (heap, current);
+  return VM_GC_MAJOR;
+}
+
+/* Choose the nursery size after a minor collection that copied
+   SURVIVORS of VOLUME bytes in PAUSE seconds.  The nursery had been
+   filled in INTERVAL seconds. */
+static void
+nursery_resize (Heap *heap, size_t volume, size_t survivors, double pause, double interval)
+{
+  VmNurseryStats *stats = &heap->nursery_stats;
+  double survival = volume > 0 ? (double) survivors / volume : 0.0;
+  double rate = interval > 0 ? volume / interval : 0.0;
+  double size = heap->nursery_size;
+
+  if (pause > heap->pause_target)
+    size *= heap->pause_target / pause;
+  else if (survival < NURSERY_LOW_SURVIVAL)
+    /* Most objects die young, so collecting less often is cheap. */
+    size *= 2;
+
+  /* Do not collect more often than necessary at the current
+     allocation rate, but keep the predicted pause, which grows with
+     the volume, below the target. */
+  size = MAX (size, rate * NURSERY_MIN_INTERVAL);
+  if (pause > 0)
+    size = MIN (size, heap->pause_target * volume / pause);
+
+  size = MIN (size, MIN (NURSERY_MAX_SIZE, heap->heap_size / 4));
+  size = MAX (size, NURSERY_MIN_SIZE);
+  heap->nursery_size = ((size_t) size + NURSERY_GRANULE - 1) & ~(NURSERY_GRANULE - 1);
+
+  ++stats->collections;
+  stats->size = heap->nursery_size;
+  stats->min_size = MIN (stats->min_size, heap->nursery_size);
+  stats->max_size = MAX (stats->max_size, heap->nursery_size);
+  stats->survival_ratio = survival;
+  stats->allocation_rate = rate;
+  stats->pause = pause;
+}
+
+void
+collect (Heap *restrict heap, Object roots[], size_t root_count)
+{
+  double start = current_time ();
+  ++heap->collections;
+  /* The survivors are collected with the object stack. */
+  size_t volume = object_stack_size (&heap->stack);
+  size_t survivors = survivor_words (heap);
+  /* Objects kept in place until they have been unpinned are moved as
+     well.  The tenured space must also take the copy buffers of the
+     parallel workers. */
+  size_t nursery = volume / WORDSIZE + survivors + heap->unpinned + copy_slack (heap);
+
+  VmGcRecord record = { .kind = VM_GC_MINOR,
+			.start = start,
+			.bytes_before = (heap->free - heap->start + survivors) * WORDSIZE + volume };
+  size_t freed[VM_RESOURCE_COUNT];
+  memcpy (freed, heap->resource_manager.freed, sizeof freed);
+  size_t heap_symbols;
+  symbol_table_sizes (&heap->symbol_table, &record.nursery_symbols, &heap_symbols);
+  heap->copied = 0;
+
+  /* The tenured space is grown to take the survivors of the nursery
+     if they may not fit. */
+  if (nursery > free_space (heap))
+    space_resize (heap, tenured_size (heap, (heap->free - heap->start) + nursery));
+  if (nursery > free_space (heap) && heap->frozen > heap->start)
+    {
+      /* The frozen objects must not be copied.  Instead, the nursery
+	 is evacuated into the survivor spaces, which are not bounded
+	 by the heap size, and the tenured space is compacted. */
+      size_t tenuring_threshold = heap->tenuring_threshold;
+      heap->tenuring_threshold = MAX (tenuring_threshold, 2);
+      heap->evacuating = true;
+      record.remembered_set = collect_generation (heap, roots, root_count, NULL, NULL);
+      heap->evacuating = false;
+      heap->tenuring_threshold = tenuring_threshold;
+      record.kind = collect_tenured (heap, roots, root_count);
+      ++heap->emergencies;
+    }
+  else if (nursery > free_space (heap))
+    {
+      /* As the tenured space cannot grow any further, both
+	 generations are collected at once before giving up. */
+      size_t current = (heap->end - heap->start) * WORDSIZE;
+      stop_marking (heap);
+      Pointer old_end = heap->end;
+      collect_generation (heap, roots, root_count,
+			  flip (heap, (heap->free - heap->start) + nursery), old_end);
+      heap_resize (heap, current);
+      ++heap->emergencies;
+      record.kind = VM_GC_MAJOR;
+    }
+  else
+    {
+      Pointer free = heap->free;
+      record.remembered_set = collect_generation (heap, roots, root_count, NULL, NULL);
+      heap->nursery_stats.promoted += (heap->free - free) * WORDSIZE;
+      nursery_resize (heap, volume + survivors * WORDSIZE, heap->copied * WORDSIZE,
+		      current_time () - start, start - heap->mutator_start);
+      /* A marking slice follows each minor collection. */
+      bool marked = heap->compactor != NULL
+	&& compactor_drain (heap->compactor, heap->slice_budget);
+      if (marked || heap->full
+	  || free_space (heap) < heap->nursery_size / WORDSIZE
+	  || large_object_space_needs_collection (&heap->large_object_space))
+	record.kind = collect_tenured (heap, roots, root_count);
+      /* Marking starts once the free space beyond the reserve for
+	 a minor collection falls below half of the tenured space.  As
+	 this is sized to about twice the live data, it starts soon
+	 after a major collection and has the most time to finish. */
+      else if (heap->incremental && heap->compactor == NULL
+	       && 2 * free_space (heap) < (heap->end - heap->start) + heap->nursery_size / WORDSIZE)
+	heap->compactor = compactor_start (heap, roots, root_count);
+    }
+
+  release_retained (heap);
+  heap->unpinned = 0;
+  heap->nursery_stats.stack_high_water = MAX (heap->nursery_stats.stack_high_water,
+					      object_stack_size (&heap->stack));
+  heap->nursery_stats.survivors = survivor_words (heap) * WORDSIZE;
+  RetainedRegion stack = { .stack = heap->stack };
+  if (holds_pinned (heap, &stack))
+    {
+      stack_push (&heap->retained, stack);
+      object_stack_init (&heap->stack);
+    }
+  else
+    object_stack_clear (&heap->stack);
+  heap->stack.huge_pages = heap->huge_pages;
+  /* Compiled code collects at its next allocation beyond the limit
+     once as much as the nursery size has been allocated on the object
+     stack. */
+  object_stack_limit (&heap->stack, heap->nursery_size);
+  heap->mutator_start = current_time ();
+
+  record.end = heap->mutator_start;
+  record.bytes_after = (heap->free - heap->start) * WORDSIZE;
+  record.bytes_copied = heap->copied * WORDSIZE;
+  for (size_t i = 0; i < VM_RESOURCE_COUNT; ++i)
+    record.resources_freed[i] = heap->resource_manager.freed[i] - freed[i];
+  size_t nursery_symbols;
+  symbol_table_sizes (&heap->symbol_table, &nursery_symbols, &record.heap_symbols);
+  gc_telemetry_record (&heap->telemetry, &record);
+}
+
+/* Collect both generations and freeze the objects that survive: the
+   collector neither moves them nor writes to them any more, so that
+   the pages they lie on stay shared with processes forked afterwards.
+   Marks and forwarding addresses of the tenured space are kept in the
+   bitmap of the compactor.  Frozen objects are never reclaimed, even
+   once they have become unreachable, because compactor_init presets
+   their live bits. */
+void
+heap_share (Heap *heap, Object roots[], size_t root_count)
+{
+  size_t tenuring_threshold = heap->tenuring_threshold;
+  heap->tenuring_threshold = 1;
+  heap->full = true;
+  collect (heap, roots, root_count);
+  heap->full = false;
+  heap->tenuring_threshold = tenuring_threshold;
+  heap->frozen = heap->free;
 }
 
 void
 mutate (Heap *heap, Pointer slot, Object value)
 {
-  if (is_pointer (value) && !is_in_heap (heap, (Pointer) value) && is_in_heap (heap, slot))
-    mutation_table_insert (heap->mutation_table, slot);
+  /* During an incremental marking, the overwritten object is marked
+     so that everything reachable when it started is retained. */
+  if (heap->compactor != NULL)
+    compactor_shade (heap->compactor, *slot);
+  if (is_pointer (value) && !is_in_heap (heap, (Pointer) value))
+    remember (heap, slot);
   *slot = value;
 }
+
+/* Store VALUE into the COUNT fields from FIELDS on, which lie in one
+   object, as mutate does for each of them.  A single field in each
+   card is remembered. */
+void
+mutate_fill (Heap *heap, Pointer fields, size_t count, Object value)
+{
+  if (count == 0)
+    return;
+  if (heap->compactor != NULL)
+    for (size_t i = 0; i < count; ++i)
+      compactor_shade (heap->compactor, fields[i]);
+  if (is_pointer (value) && !is_in_heap (heap, (Pointer) value))
+    {
+      for (size_t i = 0; i < count; i += CARD_WORDS)
+	remember (heap, fields + i);
+      remember (heap, fields + count - 1);
+    }
+  fill_words (fields, count, value);
+}
+
+/* Pin OBJECT, which must not be a symbol, so that its address can be
+   handed to native code.  Pins nest. */
+void
+pin (Heap *heap, Object object)
+{
+  if (!is_pointer (object))
+    return;
+  Pin *pin = pin_lookup (heap, object);
+  if (pin != NULL)
+    ++pin->count;
+  else
+    stack_push (&heap->pinned, ((Pin) { .object = object, .count = 1 }));
+}
+
+void
+unpin (Heap *heap, Object object)
+{
+  Pin *pin = pin_lookup (heap, object);
+  if (pin == NULL || --pin->count > 0)
+    return;
+  *pin = stack_pop (&heap->pinned);
+  /* The next collection moves the object. */
+  if (is_kept_in_place (heap, (Pointer) object))
+    heap->unpinned += object_size (object_header ((Pointer) object));
+}
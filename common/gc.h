@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * Thunder is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3, or (at
+ * your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Authors:
+ *      Marc Nieper-Wißkirchen
+ */
+
+/* Interface between the parts of the garbage collector: the copying
+   collector in gc.c, the compactor in compactor.c and the parallel
+   copying workers in parallel.c. */
+
+#ifndef GC_H_INCLUDED
+#define GC_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "stack.h"
+#include "vmcommon.h"
+
+/* Objects are made of granules of ALIGNMENT bytes. */
+#define GRANULE_WORDS (ALIGNMENT / WORDSIZE)
+
+static inline bool
+is_in_heap (Heap *heap, Pointer object)
+{
+  /* The free pointer is advanced concurrently during a parallel
+     collection. */
+  return object >= heap->start && object < __atomic_load_n (&heap->free, __ATOMIC_RELAXED);
+}
+
+static inline bool
+is_ephemeron_header (Object header)
+{
+  return (header & HEADER_TYPE_MASK) == (EPHEMERON_TYPE & HEADER_TYPE_MASK);
+}
+
+static inline bool
+is_resource (Object object)
+{
+  return is_pointer (object) && is_unmanaged ((Pointer) object);
+}
+
+/* Parallel copying */
+
+/* Size of the parallel copy buffer a worker allocates at once. */
+#define PLAB_WORDS 1024
+
+typedef struct grey_range GreyRange;
+struct grey_range
+{
+  Pointer start;
+  Pointer end;
+};
+
+/* Ranges of copied but not yet scanned objects.  The owning worker
+   pops from the top; other workers steal from the bottom. */
+typedef struct grey_deque GreyDeque;
+struct grey_deque
+{
+  STACK(GreyRange) ranges;
+  ptrdiff_t bottom;
+  pthread_mutex_t lock;
+};
+
+typedef struct worker_pool WorkerPool;
+
+typedef struct worker Worker;
+struct worker
+{
+  Heap *heap;
+  WorkerPool *pool;
+  Pointer scan;
+  Pointer free;
+  Pointer end;
+  GreyDeque grey;
+  size_t copied;
+  pthread_t thread;
+};
+
+struct worker_pool
+{
+  Worker *workers;
+  size_t count;
+  size_t idle;
+};
+
+void
+worker_pool_init (WorkerPool *pool, Heap *heap, size_t count);
+
+void
+worker_pool_run (WorkerPool *pool);
+
+void
+worker_pool_destroy (WorkerPool *pool);
+
+void
+grey_push (GreyDeque *grey, Pointer start, Pointer end);
+
+Pointer
+copy_parallel (Worker *worker, Pointer from);
+
+/* Compaction */
+
+typedef struct compactor Compactor;
+
+Compactor *
+compactor_start (Heap *heap, Object roots[], size_t root_count);
+
+bool
+compactor_drain (Compactor *compactor, double budget);
+
+void
+compactor_finish (Compactor *compactor, Object roots[], size_t root_count);
+
+void
+compactor_shade (Compactor *compactor, Object object);
+
+void
+stop_marking (Heap *heap);
+
+/* Copying collection */
+
+double
+current_time (void);
+
+void
+card_table_clear (CardTable *table);
+
+void
+card_table_record (Heap *heap, Pointer object, size_t size);
+
+void
+remember (Heap *heap, Pointer slot);
+
+bool
+is_kept_in_place (Heap *heap, Pointer pointer);
+
+bool
+is_survivor (Heap *heap, Pointer pointer);
+
+size_t
+survivor_words (Heap *heap);
+
+Pointer
+survivor_allocate (Heap *heap, Worker *worker, Pointer from, size_t size);
+
+bool
+is_large (Object header, size_t size);
+
+Pointer
+heap_reserve (Heap *heap, size_t min, size_t *size);
+
+void
+fill (Heap *heap, Pointer start, size_t size);
+
+void
+scan (Heap *heap, Worker *worker, Pointer ref);
+
+ptrdiff_t
+first_young_guarded (Heap *heap);
+
+void
+queue_guarded (Heap *heap, ptrdiff_t ready);
+
+#endif /* GC_H_INCLUDED */
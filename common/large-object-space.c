@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * Thunder is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3, or (at
+ * your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Authors:
+ *      Marc Nieper-Wißkirchen
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "deque.h"
+#include "stack.h"
+#include "vmcommon.h"
+#include "xalloc.h"
+
+/* Number of bytes preceding a large object on its first page. */
+#define LARGE_OBJECT_OFFSET \
+  ((sizeof (LargeObject) + ALIGNMENT_MASK) & ~ALIGNMENT_MASK)
+
+/* A major collection of the large object space is due if the pages
+   of old objects exceed twice the pages live after the last one by
+   this number. */
+#define LARGE_OBJECT_SLACK_PAGES 256
+
+void
+large_object_space_init (LargeObjectSpace *space, size_t size)
+{
+  space->page_count = size >> LARGE_PAGE_SHIFT;
+  /* The region is only reserved; pages are committed when first
+     touched. */
+  space->base = mmap (NULL, space->page_count << LARGE_PAGE_SHIFT,
+		      PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (space->base == MAP_FAILED)
+    xalloc_die ();
+  space->top = 0;
+  space->old_pages = 0;
+  space->live_pages = 0;
+  space->marking = false;
+  space->owners = XCALLOC (space->page_count, LargeObject *);
+  space->cards = xzalloc (space->page_count);
+  deque_init (&space->nursery_list);
+  deque_init (&space->heap_list);
+  stack_init (&space->grey);
+  pthread_mutex_init (&space->lock, NULL);
+}
+
+void
+large_object_space_destroy (LargeObjectSpace *space)
+{
+  pthread_mutex_destroy (&space->lock);
+  stack_destroy (&space->grey);
+  free (space->cards);
+  free (space->owners);
+  munmap (space->base, space->page_count << LARGE_PAGE_SHIFT);
+}
+
+static size_t
+page_index (LargeObjectSpace *space, void *pointer)
+{
+  return ((char *) pointer - space->base) >> LARGE_PAGE_SHIFT;
+}
+
+bool
+large_object_space_contains (LargeObjectSpace *space, Pointer pointer)
+{
+  return (char *) pointer >= space->base
+    && (char *) pointer < space->base + (space->page_count << LARGE_PAGE_SHIFT);
+}
+
+LargeObject *
+large_object_space_owner (LargeObjectSpace *space, Pointer pointer)
+{
+  return space->owners[page_index (space, pointer)];
+}
+
+Pointer
+large_object_start (LargeObject *object)
+{
+  return (Pointer) ((char *) object + LARGE_OBJECT_OFFSET);
+}
+
+/* Find a run of COUNT free pages, first fit. */
+static size_t
+find_pages (LargeObjectSpace *space, size_t count)
+{
+  size_t run = 0;
+  for (size_t i = 0; i < space->top; )
+    {
+      LargeObject *owner = space->owners[i];
+      if (owner != NULL)
+	{
+	  run = 0;
+	  i += owner->page_count;
+	  continue;
+	}
+      if (++run == count)
+	return i + 1 - count;
+      ++i;
+    }
+
+  size_t start = space->top - run;
+  if (space->page_count - start < count)
+    xalloc_die ();
+  space->top = start + count;
+  return start;
+}
+
+/* Allocate a young large object of SIZE words and return a pointer to
+   its header word. */
+Pointer
+large_object_space_allocate (LargeObjectSpace *space, size_t size)
+{
+  size_t count = (LARGE_OBJECT_OFFSET + size * WORDSIZE + LARGE_PAGE_SIZE - 1) >> LARGE_PAGE_SHIFT;
+
+  pthread_mutex_lock (&space->lock);
+  size_t start = find_pages (space, count);
+  LargeObject *object = (LargeObject *) (space->base + (start << LARGE_PAGE_SHIFT));
+  for (size_t i = start; i < start + count; ++i)
+    {
+      space->owners[i] = object;
+      space->cards[i] = CARD_CLEAN;
+    }
+  object->page_count = count;
+  object->in_nursery = true;
+  /* Objects allocated during an incremental marking are live. */
+  object->marked = space->marking;
+  deque_insert (&space->nursery_list, object);
+  pthread_mutex_unlock (&space->lock);
+
+  return large_object_start (object);
+}
+
+/* Return the pages of OBJECT, which has to be unlinked, to the
+   operating system. */
+static void
+release (LargeObjectSpace *space, LargeObject *object)
+{
+  size_t start = page_index (space, object);
+  size_t count = object->page_count;
+  for (size_t i = start; i < start + count; ++i)
+    space->owners[i] = NULL;
+  madvise (object, count << LARGE_PAGE_SHIFT, MADV_DONTNEED);
+
+  while (space->top > 0 && space->owners[space->top - 1] == NULL)
+    --space->top;
+}
+
+/* Free the young large object whose header word is at POINTER. */
+void
+large_object_space_free (LargeObjectSpace *space, Pointer pointer)
+{
+  pthread_mutex_lock (&space->lock);
+  LargeObject *object = large_object_space_owner (space, pointer);
+  deque_remove (&space->nursery_list, object);
+  release (space, object);
+  pthread_mutex_unlock (&space->lock);
+}
+
+/* Mark the large object containing POINTER.  Return true if it has
+   not been marked before during this collection, in which case the
+   caller has to scan it. */
+bool
+large_object_space_mark (LargeObjectSpace *space, Pointer pointer)
+{
+  pthread_mutex_lock (&space->lock);
+  LargeObject *object = large_object_space_owner (space, pointer);
+  bool marked = object->in_nursery;
+  if (marked)
+    {
+      object->in_nursery = false;
+      space->old_pages += object->page_count;
+      deque_remove (&space->nursery_list, object);
+      deque_insert (&space->heap_list, object);
+    }
+  pthread_mutex_unlock (&space->lock);
+  return marked;
+}
+
+/* Return true if the large object containing POINTER has been marked
+   during this collection or is old during a minor one. */
+bool
+large_object_space_is_marked (LargeObjectSpace *space, Pointer pointer)
+{
+  pthread_mutex_lock (&space->lock);
+  bool marked = !large_object_space_owner (space, pointer)->in_nursery;
+  pthread_mutex_unlock (&space->lock);
+  return marked;
+}
+
+/* Record that SLOT, which lies in a large object, may point into the
+   nursery.  Young large objects are scanned as a whole when they are
+   marked. */
+void
+large_object_space_write (LargeObjectSpace *space, Pointer slot)
+{
+  size_t i = page_index (space, slot);
+  if (!space->owners[i]->in_nursery)
+    space->cards[i] = CARD_DIRTY;
+}
+
+void
+large_object_space_begin_gc (LargeObjectSpace *space, bool major_gc)
+{
+  if (!major_gc)
+    return;
+
+  /* Every large object has to be marked again.  Its fields are
+     scanned completely, so all cards become clean. */
+  memset (space->cards, CARD_CLEAN, space->top);
+  for (LargeObject *object = deque_first (&space->heap_list);
+       object != NULL;
+       object = object->deque_entries.next)
+    object->in_nursery = true;
+  deque_concat (&space->nursery_list, &space->heap_list);
+  space->old_pages = 0;
+}
+
+/* Free the large objects that have not been marked. */
+void
+large_object_space_end_gc (LargeObjectSpace *space, bool major_gc)
+{
+  LargeObject *object;
+  while ((object = deque_pop (&space->nursery_list)) != NULL)
+    release (space, object);
+  if (major_gc)
+    space->live_pages = space->old_pages;
+}
+
+bool
+large_object_space_needs_collection (LargeObjectSpace *space)
+{
+  return space->old_pages > 2 * space->live_pages + LARGE_OBJECT_SLACK_PAGES;
+}
+
+void
+large_object_space_begin_marking (LargeObjectSpace *space)
+{
+  for (LargeObject *object = deque_first (&space->nursery_list);
+       object != NULL;
+       object = object->deque_entries.next)
+    object->marked = false;
+  for (LargeObject *object = deque_first (&space->heap_list);
+       object != NULL;
+       object = object->deque_entries.next)
+    object->marked = false;
+  space->marking = true;
+}
+
+/* Mark the large object containing POINTER during an incremental
+   marking.  Return true if it has not been marked before, in which
+   case the caller has to trace it. */
+bool
+large_object_space_trace (LargeObjectSpace *space, Pointer pointer)
+{
+  LargeObject *object = large_object_space_owner (space, pointer);
+  bool marked = !object->marked;
+  object->marked = true;
+  return marked;
+}
+
+/* Start a major collection in which exactly the objects marked by
+   the incremental marking are live. */
+void
+large_object_space_end_marking (LargeObjectSpace *space)
+{
+  space->marking = false;
+  large_object_space_begin_gc (space, true);
+  LargeObject *next;
+  for (LargeObject *object = deque_first (&space->nursery_list);
+       object != NULL;
+       object = next)
+    {
+      next = object->deque_entries.next;
+      if (object->marked)
+	large_object_space_mark (space, large_object_start (object));
+    }
+}
@@ -175,7 +175,7 @@ load_object (Heap *heap, Hash_table *obj_table, Object expr, Location *loc, char
 	      frame->type = FRAME_VECTOR;
 	      frame->expr = cdr (expr);
 	      frame->len = length (frame->expr);
-	      frame->obj = make_vector (heap, frame->len, make_undefined ());
+	      frame->obj = make_vector_uninitialized (heap, frame->len);
 	      frame->index = 0;
 	      frame->prev = top;
 	      frame->depth = depth;
@@ -216,15 +216,15 @@ load_object (Heap *heap, Hash_table *obj_table, Object expr, Location *loc, char
 		{
 		case FRAME_PAIR:
 		  if (top->index == 1)
-		    set_car (heap, top->obj, expr);
+		    init_car (top->obj, expr);
 		  else
-		    set_cdr (heap, top->obj, expr);
+		    init_cdr (top->obj, expr);
 		  break;
 		case FRAME_VECTOR:
-		  vector_set (heap, top->obj, top->index - 1, expr);
+		  vector_init_element (top->obj, top->index - 1, expr);
 		  break;
 		case FRAME_CLOSURE:
-		  closure_set (heap, top->obj, top->index - 1, expr);
+		  closure_init (top->obj, top->index - 1, expr);
 		  break;
 		}
 	    }
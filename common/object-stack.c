@@ -21,69 +21,185 @@
 # include <config.h>
 #endif
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
-#include "obstack.h"
-#include "unitypes.h"
+#include "minmax.h"
 #include "vmcommon.h"
 #include "xalloc.h"
 
-#define obstack_chunk_alloc xmalloc
-#define obstack_chunk_free  free
+/* Objects are allocated in chunks of at least this number of words.
+   Chunks are small enough for the C library to allocate them without
+   mapping memory of their own. */
+#define CHUNK_WORDS ((1 << 16) / WORDSIZE)
+
+/* A chunk holds objects up to END.  The header takes ALIGNMENT bytes,
+   so the objects following it are aligned. */
+struct object_chunk
+{
+  struct object_chunk *prev;
+  Pointer end;
+  Object objects[];
+};
 
 void
 object_stack_init (ObjectStack *restrict stack)
 {
-  obstack_init (&stack->obstack);
-  obstack_alignment_mask (&stack->obstack) = ALIGNMENT_MASK;
-  stack->base = obstack_finish (&stack->obstack);
+  stack->chunk = NULL;
+  stack->free = stack->limit = NULL;
+  stack->size = 0;
+  stack->capacity = SIZE_MAX;
+  stack->huge_pages = false;
 }
 
 void
 object_stack_clear (ObjectStack *restrict stack)
 {
-  obstack_free (&stack->obstack, stack->base);
+  size_t capacity = stack->capacity;
+  bool huge_pages = stack->huge_pages;
+  object_stack_destroy (stack);
+  object_stack_init (stack);
+  stack->capacity = capacity;
+  stack->huge_pages = huge_pages;
 }
 
 void
 object_stack_destroy (ObjectStack *restrict stack)
 {
-  obstack_free (&stack->obstack, NULL);
+  struct object_chunk *chunk = stack->chunk;
+  while (chunk != NULL)
+    {
+      struct object_chunk *prev = chunk->prev;
+      free (chunk);
+      chunk = prev;
+    }
 }
 
-void
-object_stack_grow (ObjectStack *restrict stack, Object obj)
+/* Return the number of bytes allocated on the object stack. */
+size_t
+object_stack_size (ObjectStack *restrict stack)
 {
-  obstack_grow (&stack->obstack, &obj, sizeof (obj));
+  if (stack->chunk == NULL)
+    return stack->size;
+  return stack->size + (stack->free - stack->chunk->objects) * WORDSIZE;
 }
 
-void
-object_stack_grow0 (ObjectStack *restrict stack)
+/* Move the limit to where the stack becomes full, but not past the
+   end of the current chunk.  Once the stack is full, the limit is the
+   free pointer, so that compiled code collects at its next
+   allocation.  The limit only has to be moved when the chunk or the
+   capacity changes, because the point where the stack becomes full
+   does not move as objects are allocated. */
+static void
+update_limit (ObjectStack *restrict stack)
 {
-  obstack_1grow (&stack->obstack, 0);
+  if (stack->chunk == NULL)
+    return;
+  size_t size = object_stack_size (stack);
+  size_t room = size < stack->capacity ? (stack->capacity - size) / WORDSIZE : 0;
+  stack->limit = (size_t) (stack->chunk->end - stack->free) <= room
+    ? stack->chunk->end
+    : stack->free + room;
 }
 
+/* Let the stack be full once LIMIT bytes have been allocated on it
+   since it has been cleared. */
 void
-object_stack_ucs4_grow (ObjectStack *restrict stack, ucs4_t c)
+object_stack_limit (ObjectStack *restrict stack, size_t limit)
 {
-  obstack_grow (&stack->obstack, &c, sizeof (c));
+  stack->capacity = limit;
+  update_limit (stack);
 }
 
-void
-object_stack_utf8_grow (ObjectStack *restrict stack, uint8_t *s, size_t len)
+bool
+object_stack_is_full (ObjectStack *restrict stack)
 {
-  obstack_grow (&stack->obstack, s, len * sizeof (uint8_t));
+  return object_stack_size (stack) >= stack->capacity;
 }
 
-void
-object_stack_align (ObjectStack *restrict stack)
+/* Return true if POINTER lies in a chunk of the object stack. */
+bool
+object_stack_contains (ObjectStack *restrict stack, void *pointer)
+{
+  for (struct object_chunk *chunk = stack->chunk; chunk != NULL; chunk = chunk->prev)
+    if ((Pointer) pointer >= chunk->objects && (Pointer) pointer < chunk->end)
+      return true;
+  return false;
+}
+
+/* Return true if a chunk of the object stack overlaps the addresses
+   between START and END. */
+bool
+object_stack_overlaps (ObjectStack *restrict stack, uintptr_t start, uintptr_t end)
+{
+  for (struct object_chunk *chunk = stack->chunk; chunk != NULL; chunk = chunk->prev)
+    if (start < (uintptr_t) chunk->end && (uintptr_t) chunk < end)
+      return true;
+  return false;
+}
+
+/* Continue the stack in a new chunk that takes at least WORDS words.
+   The rest of the current chunk is left unused.  With huge pages,
+   chunks are made of whole huge pages. */
+static void
+push_chunk (ObjectStack *restrict stack, size_t words)
+{
+  size_t bytes = sizeof (struct object_chunk) + MAX (words, CHUNK_WORDS) * WORDSIZE;
+  struct object_chunk *chunk;
+  if (stack->huge_pages)
+    {
+      bytes = (bytes + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE;
+      chunk = xaligned_alloc (HUGE_PAGE_SIZE, bytes);
+#ifdef MADV_HUGEPAGE
+      madvise (chunk, bytes, MADV_HUGEPAGE);
+#endif
+    }
+  else
+    chunk = xaligned_alloc (ALIGNMENT, bytes);
+  if (stack->chunk != NULL)
+    stack->size += (stack->free - stack->chunk->objects) * WORDSIZE;
+  chunk->prev = stack->chunk;
+  chunk->end = chunk->objects + (bytes - sizeof (struct object_chunk)) / WORDSIZE;
+  stack->chunk = chunk;
+  stack->free = chunk->objects;
+  update_limit (stack);
+}
+
+static size_t
+granule_words (size_t size)
+{
+  return (size + ALIGNMENT / WORDSIZE - 1) & ~(size_t) (ALIGNMENT / WORDSIZE - 1);
+}
+
+/* Return SIZE words for a new object, rounded up to the alignment.
+   The word of padding is an immediate value so that the collector can
+   scan it. */
+Pointer
+object_stack_alloc (ObjectStack *restrict stack, size_t size)
 {
-  size_t size = obstack_object_size (&stack->obstack);
-  
-  obstack_blank (&stack->obstack, ((size + ALIGNMENT_MASK) & ~ALIGNMENT_MASK) - size);
+  size_t words = granule_words (size);
+  if (stack->chunk == NULL || stack->chunk->end - stack->free < (ptrdiff_t) words)
+    push_chunk (stack, words);
+  Pointer p = stack->free;
+  stack->free = p + words;
+  if (words != size)
+    p[size] = make_undefined ();
+  return p;
 }
 
-Object
-object_stack_finish (ObjectStack *restrict stack)
+/* Make room for SIZE words between FREE and LIMIT, into which
+   compiled code allocates by bumping FREE itself.  Return false
+   instead if the stack is full, so that the nursery is collected
+   first. */
+bool
+object_stack_reserve (ObjectStack *restrict stack, size_t size)
 {
-  return (Object) obstack_finish (&stack->obstack);
+  if (object_stack_is_full (stack))
+    return false;
+  size_t words = granule_words (size);
+  if (stack->chunk == NULL || stack->chunk->end - stack->free < (ptrdiff_t) words)
+    push_chunk (stack, words);
+  stack->limit = MAX (stack->limit, stack->free + words);
+  return true;
 }
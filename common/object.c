@@ -21,11 +21,14 @@
 # include <config.h>
 #endif
 #include <stddef.h>
+#include <string.h>
 
 #include "error.h"
+#include "minmax.h"
 #include "uniconv.h"
 #include "unistr.h"
 #include "unitypes.h"
+#include "xalloc.h"
 
 #include "vmcommon.h"
 
@@ -62,12 +65,21 @@ is_binary (Object header)
   return (header & BINARY_TYPE) == BINARY_TYPE;
 }
 
+static bool
+is_header (Object object)
+{
+  return (object & OBJECT_TYPE_MASK) == HEADER_TYPE;
+}
+
 bool
 is_well_known_symbol (Pointer pointer)
 {
   if (is_pair ((Object) pointer))
     return false;
-  return (pointer[-1] & WELL_KNOWN_SYMBOL) == WELL_KNOWN_SYMBOL;
+  /* The word before the object may also be a link field or, during a
+     collection, a forwarding address. */
+  return is_header (pointer[-1])
+    && (pointer[-1] & WELL_KNOWN_SYMBOL) == WELL_KNOWN_SYMBOL;
 }
 
 static bool
@@ -100,12 +112,6 @@ align_size (Object size)
   return (size + 2 * WORDSIZE - 1) & ~(2 * WORDSIZE - 1);
 }
 
-static bool
-is_header (Object object)
-{
-  return (object & OBJECT_TYPE_MASK) == HEADER_TYPE;
-}
-
 static Object
 header_payload (Object header)
 {
@@ -141,7 +147,8 @@ object_size (Pointer pointer)
        word. */
     return align_size (pointer [1]) / WORDSIZE + 2;
 
-  return align_size (payload) / WORDSIZE;
+  /* The header encodes the number of words following it. */
+  return align_size ((payload + 1) * WORDSIZE) / WORDSIZE;
 }
 
 Object
@@ -153,13 +160,17 @@ make_mark (Pointer to)
 Pointer
 object_pointers (Pointer header)
 {
+  /* A pair has no header; both of its fields may be pointers. */
+  if (!is_header (*header))
+    return header;
+
   if (is_binary (*header))
     return NULL;
 
   Pointer end = header + object_size (header);
   
   /* Skip size field if present. */  
-  Pointer start = header_payload (*header) ? header + 2 : header + 1;
+  Pointer start = header_payload (*header) ? header + 1 : header + 2;
   
   while (start < end)
     {
@@ -253,12 +264,46 @@ is_boolean (Object obj)
   return (obj & IMMEDIATE_TYPE_MASK) == BOOLEAN_TYPE;
 }
 
+/* Count an allocation of BYTES bytes of objects of TYPE by the
+   caller of the allocating function, whose return address is SITE. */
+static void
+count_allocation (Heap *heap, void const *site, char const *type, size_t bytes)
+{
+  AllocProfile *profile = &heap->alloc_profile;
+  if (profile->interval != 0 && (profile->countdown -= bytes) <= 0)
+    alloc_profile_sample (profile, site, type, bytes);
+}
+
+static size_t
+aligned_size (size_t bytes)
+{
+  return (bytes + ALIGNMENT_MASK) & ~(size_t) ALIGNMENT_MASK;
+}
+
+/* Return SIZE words in the nursery for a new object.  Only the limit
+   of the object stack is checked. */
+Pointer
+alloc_words (Heap *heap, size_t size)
+{
+  ObjectStack *stack = &heap->stack;
+  size_t words = (size + ALIGNMENT / WORDSIZE - 1) & ~(size_t) (ALIGNMENT / WORDSIZE - 1);
+  if (stack->limit - stack->free < (ptrdiff_t) words)
+    return object_stack_alloc (stack, size);
+  Pointer p = stack->free;
+  stack->free = p + words;
+  if (words != size)
+    p[size] = make_undefined ();
+  return p;
+}
+
 Object
 cons (Heap *heap, Object car, Object cdr)
 {
-  object_stack_grow (&heap->stack, car);
-  object_stack_grow (&heap->stack, cdr);
-  return object_stack_finish (&heap->stack) | PAIR_TYPE;
+  count_allocation (heap, __builtin_return_address (0), "pair", 2 * WORDSIZE);
+  Pointer p = alloc_words (heap, 2);
+  p[0] = car;
+  p[1] = cdr;
+  return (Object) p | PAIR_TYPE;
 }
 
 Object
@@ -297,40 +342,223 @@ set_cdr (Heap *heap, Object pair, Object cdr)
   mutate (heap, ((Pointer) pair) + 1, cdr);
 }
 
+/* The init functions store the initial value of a field of an object
+   that has been allocated since the last collection.  Such an object
+   lies in the nursery, which each collection scans completely, and
+   the value it replaces is not reachable, so the barrier of mutate is
+   not needed. */
+void
+init_car (Object pair, Object car)
+{
+  ((Pointer) pair)[0] = car;
+}
+
+void
+init_cdr (Object pair, Object cdr)
+{
+  ((Pointer) pair)[1] = cdr;
+}
+
 bool
 is_pair (Object object)
 {
   return (object & OBJECT_TYPE_MASK) == PAIR_TYPE;
 }
 
+/* Return a fresh object with HEADER and PAYLOAD size in the large
+   object space if it is large enough, and NULL otherwise. */
+static Pointer
+allocate_large (Heap *heap, Object header, Object payload)
+{
+  Object words[2] = { header, payload };
+  size_t size = object_size (words);
+  if (size * WORDSIZE < LARGE_OBJECT_SIZE)
+    return NULL;
+
+  Pointer p = large_object_space_allocate (&heap->large_object_space, size);
+  p[0] = header;
+  p[1] = payload;
+  /* Like the object stack, pad with an immediate value. */
+  p[size - 1] = make_undefined ();
+  return p;
+}
+
+
+/* Strings */
+
+/* The characters of a string are stored in one, two or four bytes
+   each, whichever is enough for all of them: as Latin-1, UCS-2 or
+   UCS-4.  If a character is stored that does not fit, the characters
+   are copied into a wider string, which the payload of the original
+   one refers to from then on.  Its header becomes WIDENED_STRING_TYPE,
+   which is not binary, so that the collector traces the reference. */
+
+static Object const string_types[] =
+  { [1] = LATIN1_STRING_TYPE, [2] = UCS2_STRING_TYPE, [4] = STRING_TYPE };
+
+/* Return the number of bytes needed to store C. */
+static int
+char_width (ucs4_t c)
+{
+  return c <= 0xff ? 1 : c <= 0xffff ? 2 : 4;
+}
+
+static ucs4_t
+load_char (void const *s, int width, size_t index)
+{
+  switch (width)
+    {
+    case 1:
+      return ((uint8_t const *) s)[index];
+    case 2:
+      return ((uint16_t const *) s)[index];
+    default:
+      return ((uint32_t const *) s)[index];
+    }
+}
+
+static void
+store_char (void *s, int width, size_t index, ucs4_t c)
+{
+  switch (width)
+    {
+    case 1:
+      ((uint8_t *) s)[index] = c;
+      break;
+    case 2:
+      ((uint16_t *) s)[index] = c;
+      break;
+    default:
+      ((uint32_t *) s)[index] = c;
+    }
+}
+
+/* Return a string of LENGTH characters of WIDTH bytes each, of which
+   only the terminating one is set, for the allocation at SITE. */
+static Pointer
+allocate_string (Heap *heap, size_t length, int width, void *site)
+{
+  size_t bytes = (length + 1) * width;
+  count_allocation (heap, site, "string", aligned_size (2 * WORDSIZE + bytes));
+  Pointer p = allocate_large (heap, string_types[width], bytes);
+  if (p == NULL)
+    {
+      p = alloc_words (heap, 2 + (bytes + WORDSIZE - 1) / WORDSIZE);
+      p[0] = string_types[width];
+      p[1] = bytes;
+    }
+  store_char (p + 2, width, length, 0);
+  return p;
+}
+
+/* Return the string that holds the characters of STRING. */
+static Pointer
+string_contents (Object string)
+{
+  Pointer p = (Pointer) string;
+  if ((p[-1] & HEADER_TYPE_MASK) == WIDENED_STRING_TYPE)
+    return (Pointer) p[1];
+  return p;
+}
+
+static int
+contents_width (Pointer contents)
+{
+  switch (contents[-1] & HEADER_TYPE_MASK)
+    {
+    case LATIN1_STRING_TYPE:
+      return 1;
+    case UCS2_STRING_TYPE:
+      return 2;
+    default:
+      return 4;
+    }
+}
+
 Object
 make_string (Heap *heap, size_t length, ucs4_t c)
 {
-  object_stack_grow (&heap->stack, STRING_TYPE);
-  object_stack_grow (&heap->stack, (length + 1) * sizeof (ucs4_t));
-  for (int i = 0; i < length; ++i)
-    object_stack_ucs4_grow (&heap->stack, c);
-  object_stack_ucs4_grow (&heap->stack, 0);
-  object_stack_align (&heap->stack);
-  return object_stack_finish (&heap->stack) | POINTER_TYPE;
+  int width = char_width (c);
+  Pointer p = allocate_string (heap, length, width, __builtin_return_address (0));
+  switch (width)
+    {
+    case 1:
+      memset (p + 2, c, length);
+      break;
+    case 2:
+      for (size_t i = 0; i < length; ++i)
+	((uint16_t *) (p + 2))[i] = c;
+      break;
+    default:
+      for (size_t i = 0; i < length; ++i)
+	((uint32_t *) (p + 2))[i] = c;
+    }
+  return (Object) p | POINTER_TYPE;
 }
 
-uint32_t *
+/* Return a string of the N bytes at S, which are encoded in UTF-8. */
+Object
+string_from_utf8 (Heap *heap, uint8_t const *s, size_t n)
+{
+  size_t length = 0;
+  int width = 1;
+  for (size_t i = 0; i < n; ++length)
+    {
+      ucs4_t c;
+      i += u8_mbtouc_unsafe (&c, s + i, n - i);
+      width = MAX (width, char_width (c));
+    }
+  Pointer p = allocate_string (heap, length, width, __builtin_return_address (0));
+  for (size_t i = 0, j = 0; i < n; ++j)
+    {
+      ucs4_t c;
+      i += u8_mbtouc_unsafe (&c, s + i, n - i);
+      store_char (p + 2, width, j, c);
+    }
+  return (Object) p | POINTER_TYPE;
+}
+
+/* Return the number of bytes each character of STRING is stored in. */
+int
+string_width (Object string)
+{
+  return contents_width (string_contents (string));
+}
+
+/* Return the characters of STRING, each of which is stored in
+   string_width bytes, followed by a zero character. */
+void *
 string_bytes (Object string)
 {
-  return (uint32_t *) (((Pointer) string) + 1);
+  return string_contents (string) + 1;
 }
 
 size_t
 string_length (Object string)
 {
-  return ((Pointer) string)[0] / sizeof (ucs4_t) - 1;
+  Pointer contents = string_contents (string);
+  return contents[0] / contents_width (contents) - 1;
 }
 
 char *
-string_value (Object sym)
+string_value (Object string)
 {
-  void *s = u32_strconv_to_locale ((uint32_t const *) &((Pointer) sym)[1]);
+  Pointer contents = string_contents (string);
+  int width = contents_width (contents);
+  if (width == 4)
+    {
+      void *s = u32_strconv_to_locale ((uint32_t const *) (contents + 1));
+      if (s == NULL)
+	xalloc_die ();
+      return s;
+    }
+  /* The terminating character is converted as well. */
+  size_t count = contents[0] / width;
+  uint32_t *chars = XNMALLOC (count, uint32_t);
+  for (size_t i = 0; i < count; ++i)
+    chars[i] = load_char (contents + 1, width, i);
+  void *s = u32_strconv_to_locale (chars);
+  free (chars);
   if (s == NULL)
     xalloc_die ();
   return s;
@@ -339,46 +567,93 @@ string_value (Object sym)
 ucs4_t
 string_ref (Object string, size_t index)
 {
-  return ((uint32_t *) (((Pointer) string) + 1))[index];
+  Pointer contents = string_contents (string);
+  return load_char (contents + 1, contents_width (contents), index);
 }
 
+/* Store C at INDEX of STRING, which is widened first if C does not fit
+   into the width of its characters. */
 void
-string_set (Object string, size_t index, ucs4_t c)
+string_set (Heap *heap, Object string, size_t index, ucs4_t c)
 {
-  ((uint32_t *) (((Pointer) string) + 1))[index] = c;
+  Pointer contents = string_contents (string);
+  int width = contents_width (contents);
+  if (char_width (c) > width)
+    {
+      size_t length = contents[0] / width - 1;
+      Pointer p = allocate_string (heap, length, char_width (c),
+				   __builtin_return_address (0));
+      for (size_t i = 0; i < length; ++i)
+	store_char (p + 2, char_width (c), i, load_char (contents + 1, width, i));
+      Pointer s = (Pointer) string;
+      if (contents == s)
+	{
+	  /* The payload is turned into a reference followed by immediate
+	     values before the collector may trace it. */
+	  fill_words (s + 1, object_size (s - 1) - 2, make_undefined ());
+	  s[-1] = WIDENED_STRING_TYPE;
+	}
+      mutate (heap, s + 1, (Object) p | POINTER_TYPE);
+      contents = p + 1;
+      width = char_width (c);
+    }
+  store_char (contents + 1, width, index, c);
 }
 
 bool
 is_string (Object object)
 {
-  return (object & OBJECT_TYPE_MASK) == POINTER_TYPE
-    && (((Pointer) object)[-1] & HEADER_TYPE_MASK) == STRING_TYPE;
+  if ((object & OBJECT_TYPE_MASK) != POINTER_TYPE)
+    return false;
+  switch (((Pointer) object)[-1] & HEADER_TYPE_MASK)
+    {
+    case STRING_TYPE:
+    case LATIN1_STRING_TYPE:
+    case UCS2_STRING_TYPE:
+    case WIDENED_STRING_TYPE:
+      return true;
+    default:
+      return false;
+    }
 }
 
 Object
 string (Heap *heap, Object chars)
 {
-  int n;
-  object_stack_grow (&heap->stack, STRING_TYPE);
-  object_stack_grow (&heap->stack, 0);
-  for (n = 0; !is_null (chars); chars = cdr (chars), ++n)
-    object_stack_ucs4_grow (&heap->stack, char_value (car (chars)));
-  object_stack_align (&heap->stack);
-  Object str = object_stack_finish (&heap->stack) | POINTER_TYPE;
-  ((Pointer) str)[0] = n * sizeof (ucs4_t);
-  return str;  
+  size_t length = 0;
+  int width = 1;
+  for (Object c = chars; !is_null (c); c = cdr (c), ++length)
+    width = MAX (width, char_width (char_value (car (c))));
+  Pointer p = allocate_string (heap, length, width, __builtin_return_address (0));
+  for (size_t i = 0; i < length; chars = cdr (chars), ++i)
+    store_char (p + 2, width, i, char_value (car (chars)));
+  return (Object) p | POINTER_TYPE;
+}
+
+/* Return a symbol of LEN bytes, of which only the terminating one is
+   set. */
+static Pointer
+allocate_symbol (Heap *heap, size_t len)
+{
+  size_t bytes = (len + 1) * sizeof (uint8_t);
+  Pointer p = alloc_words (heap, 2 + (bytes + WORDSIZE - 1) / WORDSIZE);
+  p[0] = SYMBOL_TYPE;
+  p[1] = bytes;
+  ((uint8_t *) (p + 2))[len] = 0;
+  return p;
 }
 
 Object
 make_symbol (Heap *heap, uint8_t *s, size_t len)
 {
-  object_stack_grow (&heap->stack, SYMBOL_TYPE);
-  object_stack_grow (&heap->stack, (len + 1) * sizeof (uint8_t));
-  object_stack_utf8_grow (&heap->stack, s, len);
-  object_stack_grow0 (&heap->stack);
-  object_stack_align (&heap->stack);
-  Object sym = object_stack_finish (&heap->stack) | POINTER_TYPE;
-  return symbol_table_intern (&heap->symbol_table, sym, false);
+  Pointer p = allocate_symbol (heap, len);
+  memcpy (p + 2, s, len * sizeof (uint8_t));
+  Object sym = (Object) p | POINTER_TYPE;
+  /* An interned symbol may not have been reachable when an
+     incremental marking started. */
+  sym = symbol_table_intern (&heap->symbol_table, sym, false);
+  shade (heap, sym);
+  return sym;
 }
 
 bool
@@ -412,31 +687,85 @@ symbol_value (Object sym)
 Object
 symbol (Heap *heap, Object chars)
 {
-  int n;
   uint8_t s[6];
-  object_stack_grow (&heap->stack, SYMBOL_TYPE);
-  object_stack_grow (&heap->stack, 0);
-  for (n = 0; !is_null (chars); chars = cdr (chars), ++n)
+  size_t len = 0;
+  for (Object c = chars; !is_null (c); c = cdr (c))
+    len += u8_uctomb (s, char_value (car (c)), 6);
+  Pointer p = allocate_symbol (heap, len);
+  uint8_t *bytes = (uint8_t *) (p + 2);
+  for (; !is_null (chars); chars = cdr (chars))
+    bytes += u8_uctomb (bytes, char_value (car (chars)), 6);
+  Object sym = (Object) p | POINTER_TYPE;
+  sym = symbol_table_intern (&heap->symbol_table, sym, false);
+  shade (heap, sym);
+  return sym;
+}
+
+/* Return a vector of LENGTH elements, none of which is set, for the
+   allocation at SITE. */
+static Pointer
+allocate_vector (Heap *heap, size_t length, void *site)
+{
+  count_allocation (heap, site, "vector", aligned_size ((length + 2) * WORDSIZE));
+  Pointer p = allocate_large (heap, VECTOR_TYPE, WORDSIZE * length);
+  if (p == NULL)
     {
-      size_t len = u8_uctomb (s, char_value (car (chars)), 6);
-      object_stack_utf8_grow (&heap->stack, s, len);
+      p = alloc_words (heap, length + 2);
+      p[0] = VECTOR_TYPE;
+      p[1] = WORDSIZE * length;
     }
-  object_stack_grow0 (&heap->stack);
-  object_stack_align (&heap->stack);
-  Object sym = object_stack_finish (&heap->stack) | POINTER_TYPE;
-  ((Pointer) sym)[0] = n * sizeof (uint8_t);
-  return symbol_table_intern (&heap->symbol_table, sym, false);
+  return p;
+}
+
+/* Store OBJECT into the COUNT words from P on.  The loop is simple
+   enough for the compiler to vectorize it. */
+void
+fill_words (Pointer p, size_t count, Object object)
+{
+  if (object == 0)
+    memset (p, 0, count * WORDSIZE);
+  else
+    for (size_t i = 0; i < count; ++i)
+      p[i] = object;
 }
 
 Object
 make_vector (Heap *heap, size_t length, Object object)
 {
-  object_stack_grow (&heap->stack, VECTOR_TYPE);
-  object_stack_grow (&heap->stack, WORDSIZE * length);
-  for (int i = 0; i < length; ++i)
-    object_stack_grow (&heap->stack, object);
-  object_stack_align (&heap->stack);
-  return object_stack_finish (&heap->stack) | POINTER_TYPE;
+  Pointer p = allocate_vector (heap, length, __builtin_return_address (0));
+  fill_words (p + 2, length, object);
+  return (Object) p | POINTER_TYPE;
+}
+
+/* Return a vector of LENGTH elements whose contents are undefined.
+   Each element has to be set by vector_init_element before the
+   next collection and before the vector is mutated. */
+Object
+make_vector_uninitialized (Heap *heap, size_t length)
+{
+  Pointer p = allocate_vector (heap, length, __builtin_return_address (0));
+  return (Object) p | POINTER_TYPE;
+}
+
+/* Return a new vector of the elements of VECTOR from START to END. */
+Object
+vector_copy (Heap *heap, Object vector, size_t start, size_t end)
+{
+  size_t length = end - start;
+  Pointer p = allocate_vector (heap, length, __builtin_return_address (0));
+  Pointer from = ((Pointer) vector) + 1 + start;
+  if (large_object_space_contains (&heap->large_object_space, p))
+    {
+      /* A long vector lies in the large object space, whose fields
+	 referring to young objects are remembered. */
+      fill_words (p + 2, length, make_undefined ());
+      for (size_t i = 0; i < length; ++i)
+	mutate (heap, p + 2 + i, from[i]);
+    }
+  else
+    /* A short vector lies in the nursery, so no barrier is needed. */
+    memcpy (p + 2, from, length * WORDSIZE);
+  return (Object) p | POINTER_TYPE;
 }
 
 size_t
@@ -457,6 +786,21 @@ vector_set (Heap *heap, Object vector, size_t index, Object value)
   mutate (heap, ((Pointer) vector) + index + 1, value);
 }
 
+/* Set element INDEX of a vector returned by make_vector_uninitialized
+   for the first time, like init_car. */
+void
+vector_init_element (Object vector, size_t index, Object value)
+{
+  ((Pointer) vector)[index + 1] = value;
+}
+
+/* Set the elements of VECTOR from START to END to VALUE. */
+void
+vector_fill (Heap *heap, Object vector, Object value, size_t start, size_t end)
+{
+  mutate_fill (heap, ((Pointer) vector) + 1 + start, end - start, value);
+}
+
 bool
 is_vector (Object object)
 {
@@ -467,11 +811,13 @@ is_vector (Object object)
 Object
 make_procedure (Heap *heap, Object code)
 {
-  object_stack_grow (&heap->stack, PROCEDURE_TYPE);
-  object_stack_grow (&heap->stack, compile (heap, code));
-  object_stack_grow (&heap->stack, copy_object (code));
-  object_stack_align (&heap->stack);
-  return object_stack_finish (&heap->stack) | POINTER_TYPE;
+  Object assembly = compile (heap, code);
+  Object copy = copy_object (code);
+  Pointer p = alloc_words (heap, 3);
+  p[0] = PROCEDURE_TYPE;
+  p[1] = assembly;
+  p[2] = copy;
+  return (Object) p | POINTER_TYPE;
 }
 
 /* TODO (XXX): Lift the assembly functions to the procedure level. */
@@ -507,20 +853,20 @@ make_closure (Heap *heap, Object proc, size_t slots, Object obj)
   size_t entries = assembly_entry_point_number (assembly);
   EntryPoint *entry_points = assembly_entry_points (assembly);
   
-  object_stack_grow (&heap->stack, CLOSURE_TYPE);
-  object_stack_grow (&heap->stack, (1 + slots + 2 * entries) * WORDSIZE);
+  Pointer p = alloc_words (heap, 3 + slots + 2 * entries);
+  p[0] = CLOSURE_TYPE;
+  p[1] = (1 + slots + 2 * entries) * WORDSIZE;
   size_t offset = 2;
-  for (int i = 0; i < entries; ++i)
+  for (size_t i = 0; i < entries; ++i)
     {
-      object_stack_grow (&heap->stack, offset * WORDSIZE | LINK_TYPE);
-      object_stack_grow (&heap->stack, (Object) entry_points [i]);
+      p[offset] = offset * WORDSIZE | LINK_TYPE;
+      p[offset + 1] = (Object) entry_points [i];
       offset += 2;
     }
-  for (int i = 0; i < slots; ++i)
-    object_stack_grow (&heap->stack, obj);
-  object_stack_grow (&heap->stack, proc);
-  object_stack_align (&heap->stack);
-  return object_stack_finish (&heap->stack) | POINTER_TYPE;
+  for (size_t i = 0; i < slots; ++i)
+    p[offset++] = obj;
+  p[offset] = proc;
+  return (Object) p | POINTER_TYPE;
 }
 
 Object
@@ -544,6 +890,13 @@ closure_set (Heap *heap, Object closure, size_t index, Object val)
   mutate (heap, ((Pointer) closure) + size - index - 1, val);  
 }
 
+void
+closure_init (Object closure, size_t index, Object val)
+{
+  size_t size = ((Pointer) closure) [0] / WORDSIZE;
+  ((Pointer) closure)[size - index - 1] = val;
+}
+
 size_t
 closure_length (Object closure)
 {
@@ -563,13 +916,104 @@ is_closure (Object obj)
 int
 closure_call (Vm *vm, Object closure, size_t entry_point)
 {
-  void *heap_area = xaligned_alloc (0x10000, 1ULL << 20);  /* TODO(XXX): Make adaptable. */
-  int res = trampoline (vm,
-			(EntryPoint) ((Pointer) closure) [2 + 2 * entry_point],
-			heap_area,
-			(Pointer) closure);
-  free (heap_area);
-  return res;
+  return trampoline (vm,
+		     (EntryPoint) ((Pointer) closure) [2 + 2 * entry_point],
+		     (Pointer) closure);
+}
+
+
+/* Ephemerons */
+
+/* The value of an ephemeron is only retained while its key is
+   reachable by other means.  Otherwise, the collector breaks the
+   ephemeron by replacing both with the undefined object. */
+Object
+make_ephemeron (Heap *heap, Object key, Object value)
+{
+  Pointer p = alloc_words (heap, 3);
+  p[0] = EPHEMERON_TYPE;
+  p[1] = key;
+  p[2] = value;
+  return (Object) p | POINTER_TYPE;
+}
+
+bool
+is_ephemeron (Object object)
+{
+  return (object & OBJECT_TYPE_MASK) == POINTER_TYPE
+    && (((Pointer) object)[-1] & HEADER_TYPE_MASK) == (EPHEMERON_TYPE & HEADER_TYPE_MASK);
+}
+
+/* The key and value become reachable by being read, so they are shaded
+   during an incremental marking. */
+Object
+ephemeron_key (Heap *heap, Object ephemeron)
+{
+  Object key = ((Pointer) ephemeron)[0];
+  shade (heap, key);
+  return key;
+}
+
+Object
+ephemeron_value (Heap *heap, Object ephemeron)
+{
+  Object value = ((Pointer) ephemeron)[1];
+  shade (heap, value);
+  return value;
+}
+
+void
+ephemeron_set_value (Heap *heap, Object ephemeron, Object value)
+{
+  mutate (heap, ((Pointer) ephemeron) + 1, value);
+}
+
+bool
+ephemeron_is_broken (Object ephemeron)
+{
+  return is_undefined (((Pointer) ephemeron)[0]);
+}
+
+
+/* Guardians */
+
+/* An object registered with a guardian is retained by the collector
+   once it is no longer reachable otherwise, and queued in the
+   guardian, from which it can be retrieved to release what it holds.
+   Only the collector refers to the registration, a pair of the object
+   and the guardian, which becomes an element of the queue. */
+Object
+make_guardian (Heap *heap)
+{
+  Pointer p = alloc_words (heap, 2);
+  p[0] = GUARDIAN_TYPE;
+  p[1] = make_null ();
+  return (Object) p | POINTER_TYPE;
+}
+
+bool
+is_guardian (Object object)
+{
+  return (object & OBJECT_TYPE_MASK) == POINTER_TYPE
+    && (((Pointer) object)[-1] & HEADER_TYPE_MASK) == (GUARDIAN_TYPE & HEADER_TYPE_MASK);
+}
+
+void
+guardian_register (Heap *heap, Object guardian, Object object)
+{
+  stack_push (&heap->guarded, cons (heap, object, guardian));
+}
+
+/* Return the next object queued in GUARDIAN, or false if there is
+   none. */
+Object
+guardian_retrieve (Heap *heap, Object guardian)
+{
+  Object queue = ((Pointer) guardian)[0];
+  if (is_null (queue))
+    return make_boolean (false);
+  mutate (heap, (Pointer) guardian, cdr (queue));
+  return car (queue);
 }
 
 
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * Thunder is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3, or (at
+ * your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Authors:
+ *      Marc Nieper-Wißkirchen
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "gc.h"
+#include "minmax.h"
+#include "stack.h"
+#include "vmcommon.h"
+#include "xalloc.h"
+
+static void
+grey_init (GreyDeque *grey)
+{
+  stack_init (&grey->ranges);
+  grey->bottom = 0;
+  pthread_mutex_init (&grey->lock, NULL);
+}
+
+static void
+grey_destroy (GreyDeque *grey)
+{
+  pthread_mutex_destroy (&grey->lock);
+  stack_destroy (&grey->ranges);
+}
+
+void
+grey_push (GreyDeque *grey, Pointer start, Pointer end)
+{
+  pthread_mutex_lock (&grey->lock);
+  stack_push (&grey->ranges, ((GreyRange) { .start = start, .end = end }));
+  pthread_mutex_unlock (&grey->lock);
+}
+
+static bool
+grey_take (GreyDeque *grey, GreyRange *range, bool steal)
+{
+  pthread_mutex_lock (&grey->lock);
+  bool found = grey->bottom < stack_size (&grey->ranges);
+  if (found)
+    {
+      *range = steal ? grey->ranges.base[grey->bottom++] : stack_pop (&grey->ranges);
+      if (grey->bottom == stack_size (&grey->ranges))
+	grey->bottom = grey->ranges.items = 0;
+    }
+  pthread_mutex_unlock (&grey->lock);
+  return found;
+}
+
+static bool
+grey_is_empty (GreyDeque *grey)
+{
+  pthread_mutex_lock (&grey->lock);
+  bool empty = grey->bottom == stack_size (&grey->ranges);
+  pthread_mutex_unlock (&grey->lock);
+  return empty;
+}
+
+/* Hand the unscanned part of the worker's copy buffer to the grey
+   deque and fill the unused part. */
+static void
+worker_retire (Worker *worker)
+{
+  if (worker->scan < worker->free)
+    grey_push (&worker->grey, worker->scan, worker->free);
+  fill (worker->heap, worker->free, worker->end - worker->free);
+  worker->scan = worker->free = worker->end;
+}
+
+static Pointer
+worker_allocate (Worker *worker, size_t size)
+{
+  if ((ptrdiff_t) size > worker->end - worker->free)
+    {
+      worker_retire (worker);
+      size_t plab_size = MAX (size, PLAB_WORDS);
+      worker->scan = worker->free = heap_reserve (worker->heap, size, &plab_size);
+      worker->end = worker->free + plab_size;
+    }
+  Pointer to = worker->free;
+  worker->free += size;
+  return to;
+}
+
+/* Symbols are copied under the symbol table lock because the
+   forwarding address depends on the interned copy. */
+static Pointer
+copy_symbol (Worker *worker, Pointer from)
+{
+  Heap *heap = worker->heap;
+  symbol_table_lock (&heap->symbol_table);
+  Pointer to = forwarding_address (*from);
+  if (to == NULL)
+    {
+      size_t size = object_size (from);
+      to = worker_allocate (worker, size);
+      memcpy (to, from, size * WORDSIZE);
+      card_table_record (heap, to, size);
+      to = (Pointer) symbol_table_intern (&heap->symbol_table, (Object) (to + 1), true) - 1;
+      __atomic_store_n (from, make_mark (to), __ATOMIC_RELEASE);
+    }
+  symbol_table_unlock (&heap->symbol_table);
+  return to;
+}
+
+/* Copy the object at FROM into the worker's copy buffer.  Workers
+   race to install the forwarding address in the header word; the
+   loser gives back its copy. */
+Pointer
+copy_parallel (Worker *worker, Pointer from)
+{
+  Object header = __atomic_load_n (from, __ATOMIC_ACQUIRE);
+  Pointer to = forwarding_address (header);
+  if (to != NULL)
+    return to;
+
+  if ((header & HEADER_TYPE_MASK) == SYMBOL_TYPE)
+    return copy_symbol (worker, from);
+
+  LargeObjectSpace *space = &worker->heap->large_object_space;
+  Object words[2] = { header, from[1] };
+  size_t size = object_size (words);
+  bool large = is_large (header, size);
+  Pointer survivor = large ? NULL : survivor_allocate (worker->heap, worker, from, size);
+  to = large ? large_object_space_allocate (space, size)
+    : survivor != NULL ? survivor : worker_allocate (worker, size);
+  memcpy (to + 1, from + 1, (size - 1) * WORDSIZE);
+  *to = header;
+  if (!__atomic_compare_exchange_n (from, &header, make_mark (to), false,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      if (large)
+	large_object_space_free (space, to);
+      else if (survivor != NULL)
+	fill (worker->heap, to, size);
+      else
+	worker->free -= size;
+      return forwarding_address (header);
+    }
+  worker->copied += size;
+  if (large)
+    {
+      large_object_space_mark (space, to);
+      grey_push (&worker->grey, to, to + size);
+    }
+  else if (survivor != NULL)
+    grey_push (&worker->grey, to, to + size);
+  else
+    card_table_record (worker->heap, to, size);
+  return to;
+}
+
+static bool
+worker_steal (Worker *worker, GreyRange *range)
+{
+  WorkerPool *pool = worker->pool;
+  size_t index = worker - pool->workers;
+  for (size_t i = 1; i < pool->count; ++i)
+    if (grey_take (&pool->workers[(index + i) % pool->count].grey, range, true))
+      return true;
+  return false;
+}
+
+/* Wait until either some worker has grey ranges to steal or all
+   workers are idle.  Return true in the latter case. */
+static bool
+worker_idle (Worker *worker)
+{
+  WorkerPool *pool = worker->pool;
+  __atomic_add_fetch (&pool->idle, 1, __ATOMIC_ACQ_REL);
+  for (;;)
+    {
+      if (__atomic_load_n (&pool->idle, __ATOMIC_ACQUIRE) == pool->count)
+	return true;
+      for (size_t i = 0; i < pool->count; ++i)
+	if (!grey_is_empty (&pool->workers[i].grey))
+	  {
+	    __atomic_sub_fetch (&pool->idle, 1, __ATOMIC_ACQ_REL);
+	    return false;
+	  }
+      sched_yield ();
+    }
+}
+
+static void *
+worker_run (void *data)
+{
+  Worker *worker = data;
+  GreyRange range;
+
+  for (;;)
+    {
+      if (worker->scan < worker->free)
+	{
+	  Pointer ref = worker->scan;
+	  worker->scan += object_size (ref);
+	  scan (worker->heap, worker, ref);
+	  continue;
+	}
+
+      if (grey_take (&worker->grey, &range, false) || worker_steal (worker, &range))
+	{
+	  for (Pointer ref = range.start; ref < range.end; ref += object_size (ref))
+	    scan (worker->heap, worker, ref);
+	  continue;
+	}
+
+      if (worker_idle (worker))
+	return NULL;
+    }
+}
+
+void
+worker_pool_init (WorkerPool *pool, Heap *heap, size_t count)
+{
+  pool->workers = XNMALLOC (count, Worker);
+  pool->count = count;
+  pool->idle = 0;
+  for (size_t i = 0; i < count; ++i)
+    {
+      Worker *worker = &pool->workers[i];
+      worker->heap = heap;
+      worker->pool = pool;
+      worker->scan = worker->free = worker->end = NULL;
+      worker->copied = 0;
+      grey_init (&worker->grey);
+    }
+}
+
+/* Run the workers until all grey objects have been scanned.  The
+   calling thread acts as the first worker. */
+void
+worker_pool_run (WorkerPool *pool)
+{
+  pool->idle = 0;
+  for (size_t i = 1; i < pool->count; ++i)
+    if (pthread_create (&pool->workers[i].thread, NULL, worker_run, &pool->workers[i]) != 0)
+      xalloc_die ();
+  worker_run (&pool->workers[0]);
+  for (size_t i = 1; i < pool->count; ++i)
+    pthread_join (pool->workers[i].thread, NULL);
+}
+
+void
+worker_pool_destroy (WorkerPool *pool)
+{
+  for (size_t i = 0; i < pool->count; ++i)
+    {
+      Worker *worker = &pool->workers[i];
+      fill (worker->heap, worker->free, worker->end - worker->free);
+      worker->heap->copied += worker->copied;
+      grey_destroy (&worker->grey);
+    }
+  free (pool->workers);
+}
+
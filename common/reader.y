@@ -203,10 +203,7 @@ string: STRING
              {
 	       size_t n = obstack_object_size (&$1);
 	       uint8_t *s = obstack_finish (&$1);	       
-	       size_t len = u8_mbsnlen (s, n);
-	       $$ = make_string (yyget_extra (scanner)->heap, len, 0);
-	       len *= sizeof (ucs4_t);
-	       u8_to_u32 (s, n, string_bytes ($$), &len);
+	       $$ = string_from_utf8 (yyget_extra (scanner)->heap, s, n);
 	       obstack_free (&$1, NULL);
 	     }
 
@@ -221,9 +218,9 @@ symbol: IDENTIFIER /* XXX: Rename identifier to symbol (?) */
 vector: "#(" elements ')'
           {
 	    Object *elements = obstack_finish (&$2.stack);
-	    $$ = make_vector (yyget_extra (scanner)->heap, $2.count, 0);
+	    $$ = make_vector_uninitialized (yyget_extra (scanner)->heap, $2.count);
 	    for (size_t i = 0; i < $2.count; ++i)
-	      vector_set (yyget_extra (scanner)->heap, $$, i, elements[i]);
+	      vector_init_element ($$, i, elements[i]);
 	    obstack_free (&$2.stack, NULL);
 	  }
 
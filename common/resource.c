@@ -22,6 +22,7 @@
 #endif
 #include <gmp.h>
 #include <mpc.h>
+#include <pthread.h>
 #include <stddef.h>
 
 #include "deque.h"
@@ -52,6 +53,10 @@ resource_manager_init (ResourceManager *rm)
   deque_init (&rm->free_list(id));		
   RESOURCES
 #undef ENTRY
+  rm->marking = false;
+  for (size_t i = 0; i < VM_RESOURCE_COUNT; ++i)
+    rm->freed[i] = 0;
+  pthread_mutex_init (&rm->lock, NULL);
 }
 
 void
@@ -66,6 +71,7 @@ resource_manager_destroy (ResourceManager *rm)
   deque_destroy (&rm->free_list(id));	    
   RESOURCES
 #undef ENTRY
+  pthread_mutex_destroy (&rm->lock);
 }
 
 #define ENTRY(id, type, init, destroy)			\
@@ -80,6 +86,9 @@ resource_manager_destroy (ResourceManager *rm)
       init (res->payload);				\
     }                                                   \
     res->in_nursery = true;                             \
+    /* Resources allocated during an incremental        \
+       marking are live. */                             \
+    res->marked = rm->marking;                          \
     deque_insert (&rm->nursery_list(id), res);          \
     return res;                                         \
   }
@@ -94,31 +103,95 @@ resource_manager_begin_gc (ResourceManager *rm, bool major_gc)
   if (!major_gc)
     return;
 
-#define ENTRY(id, type, init, destroy)				\
+  /* Every resource has to be marked again. */
+#define ENTRY(id, type, init, destroy)					\
+  for (Resource(id) *res = deque_first (&rm->heap_list(id));		\
+       res != NULL;							\
+       res = res->deque_entries.next)					\
+    res->in_nursery = true;						\
   deque_concat (&rm->nursery_list(id), &rm->heap_list(id));
   RESOURCES
 #undef ENTRY
 }
 
+/* The resources that have not been marked are freed and counted. */
 void
 resource_manager_end_gc (ResourceManager *rm)
 {
-#define ENTRY(id, type, init, destroy)				\
+#define ENTRY(id, type, init, destroy)					\
+  for (Resource(id) *res = deque_first (&rm->nursery_list(id));		\
+       res != NULL;							\
+       res = res->deque_entries.next)					\
+    ++rm->freed[VM_RESOURCE_##id];					\
   deque_concat (&rm->free_list(id), &rm->nursery_list(id));
   RESOURCES
 #undef ENTRY
 }
 
+/* Resources may be marked concurrently by parallel collector
+   threads. */
 #define ENTRY(id, type, init, destroy)					\
   void									\
   resource_manager_mark_##id (ResourceManager *rm, Resource(id) *res)	\
   {									\
-    if (!rm->major_gc && !res->in_nursery)				\
-      return;								\
-    res->in_nursery = false;						\
-    deque_remove (&rm->nursery_list(id), res);				\
-    deque_insert (&rm->heap_list(id), res);				\
+    pthread_mutex_lock (&rm->lock);					\
+    if (res->in_nursery)						\
+      {									\
+	res->in_nursery = false;					\
+	deque_remove (&rm->nursery_list(id), res);			\
+	deque_insert (&rm->heap_list(id), res);				\
+      }									\
+    pthread_mutex_unlock (&rm->lock);					\
+  }
+RESOURCES
+#undef ENTRY
+
+void
+resource_manager_begin_marking (ResourceManager *rm)
+{
+#define ENTRY(id, type, init, destroy)				\
+  for (Resource(id) *res = deque_first (&rm->nursery_list(id));	\
+       res != NULL;						\
+       res = res->deque_entries.next)				\
+    res->marked = false;					\
+  for (Resource(id) *res = deque_first (&rm->heap_list(id));	\
+       res != NULL;						\
+       res = res->deque_entries.next)				\
+    res->marked = false;
+  RESOURCES
+#undef ENTRY
+  rm->marking = true;
+}
+
+/* Mark a resource during an incremental marking. */
+#define ENTRY(id, type, init, destroy)			\
+  void							\
+  resource_manager_trace_##id (Resource(id) *res)	\
+  {							\
+    res->marked = true;					\
   }
 RESOURCES
 #undef ENTRY
 
+/* Start a major collection in which exactly the resources marked by
+   the incremental marking are live. */
+void
+resource_manager_end_marking (ResourceManager *rm)
+{
+  rm->marking = false;
+  resource_manager_begin_gc (rm, true);
+#define ENTRY(id, type, init, destroy)				\
+  {								\
+    Resource(id) *next;						\
+    for (Resource(id) *res = deque_first (&rm->nursery_list(id));	\
+	 res != NULL;						\
+	 res = next)						\
+      {								\
+	next = res->deque_entries.next;				\
+	if (res->marked)					\
+	  resource_manager_mark (id, rm, res);			\
+      }								\
+  }
+  RESOURCES
+#undef ENTRY
+}
@@ -104,7 +104,7 @@ runtime_list (Heap *heap, ...)
 	pair = list = cons (heap, obj, make_null ());
       else
 	{      
-	  set_cdr (heap, pair, cons (heap, obj, make_null ()));
+	  init_cdr (pair, cons (heap, obj, make_null ()));
 	  pair = cdr (pair);
 	}
     }
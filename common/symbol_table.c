@@ -20,7 +20,7 @@
 #ifdef HAVE_CONFIG_H
 # include <config.h>
 #endif
-#include <obstack.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "hash-pjw-bare.h"
@@ -59,12 +59,12 @@ static Object
 make_well_known_symbol (uint8_t *s)
 {
   size_t len = u8_strlen (s);
-  object_stack_grow (&symbol_stack, SYMBOL_TYPE | WELL_KNOWN_SYMBOL);
-  object_stack_grow (&symbol_stack, (len + 1) * sizeof (uint8_t));
-  object_stack_utf8_grow (&symbol_stack, s, len);
-  object_stack_grow0 (&symbol_stack);
-  object_stack_align (&symbol_stack);
-  Object sym = object_stack_finish (&symbol_stack) | POINTER_TYPE;
+  Pointer p = object_stack_alloc (&symbol_stack,
+				  2 + ((len + 1) * sizeof (uint8_t) + WORDSIZE - 1) / WORDSIZE);
+  p[0] = SYMBOL_TYPE | WELL_KNOWN_SYMBOL;
+  p[1] = (len + 1) * sizeof (uint8_t);
+  memcpy (p + 2, s, (len + 1) * sizeof (uint8_t));
+  Object sym = (Object) p | POINTER_TYPE;
   if (hash_insert (well_known_symbols, (void *) sym) == NULL)
     xalloc_die ();
   return sym;
@@ -98,6 +98,7 @@ symbol_table_init (SymbolTable *restrict symbol_table)
     xalloc_die ();
   if ((symbol_table->heap_table = hash_initialize (0, NULL, hasher, comparator, NULL)) == NULL)
     xalloc_die ();
+  pthread_mutex_init (&symbol_table->lock, NULL);
 }
 
 void
@@ -105,6 +106,7 @@ symbol_table_destroy (SymbolTable *restrict symbol_table)
 {
   hash_free (symbol_table->nursery_table);
   hash_free (symbol_table->heap_table);
+  pthread_mutex_destroy (&symbol_table->lock);
 }
 
 Object
@@ -115,6 +117,26 @@ symbol_table_clear (SymbolTable *restrict symbol_table, bool major_gc)
     hash_clear (symbol_table->heap_table);
 }
 
+/* The lock serializes the interning of symbols by parallel
+   collector threads. */
+void
+symbol_table_lock (SymbolTable *restrict symbol_table)
+{
+  pthread_mutex_lock (&symbol_table->lock);
+}
+
+void
+symbol_table_unlock (SymbolTable *restrict symbol_table)
+{
+  pthread_mutex_unlock (&symbol_table->lock);
+}
+
+void
+symbol_table_sizes (SymbolTable *restrict symbol_table, size_t *nursery_size, size_t *heap_size)
+{
+  *nursery_size = hash_get_n_entries (symbol_table->nursery_table);
+  *heap_size = hash_get_n_entries (symbol_table->heap_table);
+}
 
 /* When the GC flag is set, the symbol is inserted into the heap table
    if absent there.  When the GC flag is not set, the heap table is
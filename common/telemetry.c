@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * Thunder is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3, or (at
+ * your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Authors:
+ *      Marc Nieper-Wißkirchen
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <math.h>
+#include <stdio.h>
+
+#include "minmax.h"
+#include "vmcommon.h"
+
+/* The first bucket of the pause histogram holds the pauses up to
+   PAUSE_UNIT seconds.  Each further bucket is larger by a factor of
+   2^(1/PAUSE_STEPS). */
+#define PAUSE_UNIT  1e-6
+#define PAUSE_STEPS 4
+
+static char const *const kind_names[] = { "minor", "major", "compact" };
+
+static char const *const resource_names[] =
+  {
+#define ENTRY(id, type, init, destroy)		\
+    [VM_RESOURCE_##id] = #id,
+    RESOURCES
+#undef ENTRY
+  };
+
+void
+gc_telemetry_init (GcTelemetry *telemetry)
+{
+  telemetry->count = 0;
+  for (size_t i = 0; i < PAUSE_BUCKETS; ++i)
+    telemetry->pauses[i] = 0;
+  telemetry->total_pause = 0;
+  telemetry->max_pause = 0;
+  telemetry->log = NULL;
+}
+
+void
+gc_telemetry_destroy (GcTelemetry *telemetry)
+{
+  if (telemetry->log != NULL)
+    fclose (telemetry->log);
+}
+
+static size_t
+pause_bucket (double pause)
+{
+  if (pause <= PAUSE_UNIT)
+    return 0;
+  double bucket = ceil (PAUSE_STEPS * log2 (pause / PAUSE_UNIT));
+  return MIN (bucket, PAUSE_BUCKETS - 1);
+}
+
+static double
+pause_bucket_limit (size_t bucket)
+{
+  return PAUSE_UNIT * exp2 ((double) bucket / PAUSE_STEPS);
+}
+
+static void
+write_record (FILE *log, VmGcRecord const *record)
+{
+  fprintf (log, "{\"kind\":\"%s\",\"start\":%.9f,\"end\":%.9f,"
+	   "\"bytes_before\":%zu,\"bytes_after\":%zu,\"bytes_copied\":%zu,"
+	   "\"resources_freed\":{",
+	   kind_names[record->kind], record->start, record->end,
+	   record->bytes_before, record->bytes_after, record->bytes_copied);
+  for (size_t i = 0; i < VM_RESOURCE_COUNT; ++i)
+    fprintf (log, "%s\"%s\":%zu", i > 0 ? "," : "", resource_names[i],
+	     record->resources_freed[i]);
+  fprintf (log, "},\"remembered_set\":%zu,"
+	   "\"nursery_symbols\":%zu,\"heap_symbols\":%zu}\n",
+	   record->remembered_set, record->nursery_symbols, record->heap_symbols);
+  fflush (log);
+}
+
+void
+gc_telemetry_record (GcTelemetry *telemetry, VmGcRecord const *record)
+{
+  telemetry->records[telemetry->count++ % GC_RECORDS] = *record;
+
+  double pause = record->end - record->start;
+  ++telemetry->pauses[pause_bucket (pause)];
+  telemetry->total_pause += pause;
+  telemetry->max_pause = MAX (telemetry->max_pause, pause);
+
+  if (telemetry->log != NULL)
+    write_record (telemetry->log, record);
+}
+
+/* Return the limit of the histogram bucket holding the pause below
+   which the fraction Q of the pauses lie, but at most the longest
+   pause. */
+static double
+pause_quantile (GcTelemetry *telemetry, double q)
+{
+  size_t rank = ceil (q * telemetry->count);
+  size_t seen = 0;
+  for (size_t i = 0; i < PAUSE_BUCKETS; ++i)
+    {
+      seen += telemetry->pauses[i];
+      if (seen >= rank && seen > 0)
+	return MIN (pause_bucket_limit (i), telemetry->max_pause);
+    }
+  return telemetry->max_pause;
+}
+
+void
+gc_telemetry_stats (GcTelemetry *telemetry, VmGcStats *stats)
+{
+  stats->collections = telemetry->count;
+  stats->total_pause = telemetry->total_pause;
+  stats->p50_pause = pause_quantile (telemetry, 0.5);
+  stats->p99_pause = pause_quantile (telemetry, 0.99);
+  stats->max_pause = telemetry->max_pause;
+  stats->huge_page_bytes = 0;
+  stats->heap_size = 0;
+  stats->emergency_collections = 0;
+}
+
+/* Copy the records of the last COUNT collections at most, oldest
+   first, and return their number. */
+size_t
+gc_telemetry_records (GcTelemetry *telemetry, VmGcRecord *records, size_t count)
+{
+  count = MIN (count, MIN (telemetry->count, GC_RECORDS));
+  for (size_t i = 0; i < count; ++i)
+    records[i] = telemetry->records[(telemetry->count - count + i) % GC_RECORDS];
+  return count;
+}
@@ -25,13 +25,16 @@
 #include <lightning.h>
 #include <mpfr.h>
 #include <mpc.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "deque.h"
 #include "hash.h"
 #include "obstack.h"
+#include "stack.h"
 #include "unitypes.h"
 #include "xalloc.h"
 
@@ -83,12 +86,16 @@ typedef struct assembly Assembly[1];
 #define PORT_TYPE              (MAKE_HEADER_TYPE (3) | BINARY_TYPE | HEADER_SIZE (2))
 #define EXACT_NUMBER_TYPE      (MAKE_HEADER_TYPE (4) | UNMANAGED_TYPE)
 #define INEXACT_NUMBER_TYPE    (MAKE_HEADER_TYPE (5) | UNMANAGED_TYPE)
-#define EPHEMERON_TYPE         (MAKE_HEADER_TYPE (6) | BINARY_TYPE | HEADER_SIZE (6))
+#define EPHEMERON_TYPE         (MAKE_HEADER_TYPE (6) | BINARY_TYPE | HEADER_SIZE (2))
 #define CLOSURE_TYPE           MAKE_HEADER_TYPE (7)
 #define VECTOR_TYPE            MAKE_HEADER_TYPE (8)
 #define RECORD_TYPE            MAKE_HEADER_TYPE (9)
 #define PROCEDURE_TYPE         (MAKE_HEADER_TYPE (10) | HEADER_SIZE (2))
 #define ASSEMBLY_TYPE          (MAKE_HEADER_TYPE (11) | UNMANAGED_TYPE)
+#define GUARDIAN_TYPE          (MAKE_HEADER_TYPE (12) | HEADER_SIZE (1))
+#define LATIN1_STRING_TYPE     (MAKE_HEADER_TYPE (13) | BINARY_TYPE)
+#define UCS2_STRING_TYPE       (MAKE_HEADER_TYPE (14) | BINARY_TYPE)
+#define WIDENED_STRING_TYPE    MAKE_HEADER_TYPE (15)
 
 #define IMMEDIATE_TYPE_MASK       0xff
 #define IMMEDIATE_PAYLOAD_SHIFT   8
@@ -139,16 +146,28 @@ forwarding_address (Object from_header);
 Object
 make_mark (Pointer to);
 
-typedef Hash_table MutationTable;
-
 
 /* Object stacks */
 
+/* Objects are allocated on an object stack by bumping FREE up to
+   LIMIT, both by C code and by compiled code, which keeps FREE in a
+   register meanwhile.  The stack consists of chunks, of which CHUNK
+   is the current one; SIZE counts the bytes of the objects allocated
+   in the previous chunks since the stack has been cleared.  The stack
+   is full once CAPACITY bytes have been allocated on it.  LIMIT lies
+   no further than that point and the end of the current chunk; C
+   code may allocate past it, but compiled code then collects at its
+   next allocation.  If HUGE_PAGES is set, chunks are backed by huge
+   pages where the system allows. */
 typedef struct object_stack ObjectStack;
 struct object_stack
 {
-  struct obstack obstack;
-  void *base;
+  Pointer free;
+  Pointer limit;
+  struct object_chunk *chunk;
+  size_t size;
+  size_t capacity;
+  bool huge_pages;
 };
 
 void
@@ -160,23 +179,26 @@ object_stack_clear (ObjectStack *restrict stack);
 void
 object_stack_destroy (ObjectStack *restrict stack);
 
-void
-object_stack_grow (ObjectStack *restrict stack, Object obj);
+size_t
+object_stack_size (ObjectStack *restrict stack);
 
 void
-object_stack_grow0 (ObjectStack *restrict stack);
+object_stack_limit (ObjectStack *restrict stack, size_t limit);
 
-void
-object_stack_ucs4_grow (ObjectStack *restrict stack, ucs4_t c);
+bool
+object_stack_is_full (ObjectStack *restrict stack);
 
-void
-object_stack_utf8_grow (ObjectStack *restrict stack, uint8_t *s, size_t len);
+bool
+object_stack_contains (ObjectStack *restrict stack, void *pointer);
 
-void
-object_stack_align (ObjectStack *restrict stack);
+bool
+object_stack_overlaps (ObjectStack *restrict stack, uintptr_t start, uintptr_t end);
 
-Object
-object_stack_finish (ObjectStack *restrict stack);
+Pointer
+object_stack_alloc (ObjectStack *restrict stack, size_t size);
+
+bool
+object_stack_reserve (ObjectStack *restrict stack, size_t size);
 
 
 /* Symbol table */
@@ -186,6 +208,7 @@ struct symbol_table
 {
   Hash_table *nursery_table;
   Hash_table *heap_table;
+  pthread_mutex_t lock;
 };
 
 void
@@ -206,6 +229,15 @@ symbol_table_intern (SymbolTable *restrict symbol_table, Object sym, bool gc);
 Object
 symbol_table_clear (SymbolTable *restrict symbol_table, bool major_gc);
 
+void
+symbol_table_lock (SymbolTable *restrict symbol_table);
+
+void
+symbol_table_unlock (SymbolTable *restrict symbol_table);
+
+void
+symbol_table_sizes (SymbolTable *restrict symbol_table, size_t *nursery_size, size_t *heap_size);
+
 
 /* Resource manager */
 
@@ -225,6 +257,7 @@ symbol_table_clear (SymbolTable *restrict symbol_table, bool major_gc);
     Object header;					\
     type payload;					\
     bool in_nursery;					\
+    bool marked;					\
     DEQUE_ENTRY(resource(id));				\
   };
 RESOURCES
@@ -244,6 +277,9 @@ struct resource_manager
   RESOURCES
 #undef ENTRY
   bool major_gc;
+  bool marking;
+  size_t freed[VM_RESOURCE_COUNT];
+  pthread_mutex_t lock;
 };
 
 void
@@ -274,18 +310,349 @@ resource_manager_end_gc (ResourceManager *rm);
 RESOURCES
 #undef ENTRY
 
+void
+resource_manager_begin_marking (ResourceManager *rm);
+
+#define resource_manager_trace(id, res) resource_manager_trace_##id (res)
+
+#define ENTRY(id, type, init, destroy)			\
+  void							\
+  resource_manager_trace_##id (Resource(id) *res);
+RESOURCES
+#undef ENTRY
+
+void
+resource_manager_end_marking (ResourceManager *rm);
+
+/* Card table */
+
+#define CARD_SHIFT 9
+#define CARD_SIZE  (1 << CARD_SHIFT)
+#define CARD_WORDS (CARD_SIZE / WORDSIZE)
+
+#define CARD_CLEAN 0
+#define CARD_DIRTY 1
+
+/* The card table divides the heap into cards of CARD_SIZE bytes.  A
+   card is dirty if a slot in it may hold a pointer into the nursery.
+   For each card, OBJECTS holds the heap object covering the first
+   word of the card so that a dirty card can be scanned without
+   walking the heap from its start. */
+typedef struct card_table CardTable;
+struct card_table
+{
+  unsigned char *cards;
+  Pointer *objects;
+  size_t card_count;
+};
+
+/* Large object space */
+
+#define LARGE_OBJECT_SIZE (1ULL << 15)
+#define LARGE_PAGE_SHIFT  12
+#define LARGE_PAGE_SIZE   (1ULL << LARGE_PAGE_SHIFT)
+
+/* Objects of at least LARGE_OBJECT_SIZE bytes get pages of their own
+   in a reserved region and are marked in place instead of being
+   copied.  The LargeObject structure precedes the object on its first
+   page.  For each page, CARDS records whether it may hold a pointer
+   into the nursery.  MARKED is set by an incremental marking, during
+   which MARKING is set. */
+typedef struct large_object LargeObject;
+typedef DEQUE(large_object) LargeObjectList;
+struct large_object
+{
+  size_t page_count;
+  bool in_nursery;
+  bool marked;
+  DEQUE_ENTRY(large_object);
+};
+
+typedef struct large_object_space LargeObjectSpace;
+struct large_object_space
+{
+  char *base;
+  size_t page_count;
+  size_t top;
+  size_t old_pages;
+  size_t live_pages;
+  bool marking;
+  LargeObject **owners;
+  unsigned char *cards;
+  LargeObjectList nursery_list;
+  LargeObjectList heap_list;
+  STACK(Pointer) grey;
+  pthread_mutex_t lock;
+};
+
+void
+large_object_space_init (LargeObjectSpace *space, size_t size);
+
+void
+large_object_space_destroy (LargeObjectSpace *space);
+
+Pointer
+large_object_space_allocate (LargeObjectSpace *space, size_t size);
+
+void
+large_object_space_free (LargeObjectSpace *space, Pointer pointer);
+
+bool
+large_object_space_contains (LargeObjectSpace *space, Pointer pointer);
+
+LargeObject *
+large_object_space_owner (LargeObjectSpace *space, Pointer pointer);
+
+Pointer
+large_object_start (LargeObject *object);
+
+bool
+large_object_space_mark (LargeObjectSpace *space, Pointer pointer);
+
+bool
+large_object_space_is_marked (LargeObjectSpace *space, Pointer pointer);
+
+void
+large_object_space_write (LargeObjectSpace *space, Pointer slot);
+
+void
+large_object_space_begin_gc (LargeObjectSpace *space, bool major_gc);
+
+void
+large_object_space_end_gc (LargeObjectSpace *space, bool major_gc);
+
+bool
+large_object_space_needs_collection (LargeObjectSpace *space);
+
+void
+large_object_space_begin_marking (LargeObjectSpace *space);
+
+bool
+large_object_space_trace (LargeObjectSpace *space, Pointer pointer);
+
+void
+large_object_space_end_marking (LargeObjectSpace *space);
+
+/* Garbage collection telemetry */
+
+#define GC_RECORDS    256
+#define PAUSE_BUCKETS 128
+
+/* RECORDS holds the records of the last GC_RECORDS of the COUNT
+   collections so far.  PAUSES is a histogram of their pause times.
+   If LOG is not NULL, each record is also written to it as a line of
+   JSON. */
+typedef struct gc_telemetry GcTelemetry;
+struct gc_telemetry
+{
+  VmGcRecord records[GC_RECORDS];
+  size_t count;
+  size_t pauses[PAUSE_BUCKETS];
+  double total_pause;
+  double max_pause;
+  FILE *log;
+};
+
+void
+gc_telemetry_init (GcTelemetry *telemetry);
+
+void
+gc_telemetry_destroy (GcTelemetry *telemetry);
+
+void
+gc_telemetry_record (GcTelemetry *telemetry, VmGcRecord const *record);
+
+void
+gc_telemetry_stats (GcTelemetry *telemetry, VmGcStats *stats);
+
+size_t
+gc_telemetry_records (GcTelemetry *telemetry, VmGcRecord *records, size_t count);
+
+/* Allocation profile */
+
+#define ALLOC_PROFILE_INTERVAL 0x10000
+
+/* If INTERVAL is not zero, an allocation is sampled each time
+   INTERVAL bytes have been allocated, which COUNTDOWN counts down.
+   SITES aggregates the samples by site, which is the return address
+   of an allocating function of the runtime or the entry point of
+   compiled code, and by type of object.  If REPORT is not NULL, the
+   aggregate is written to it when the profile is destroyed. */
+typedef struct alloc_profile AllocProfile;
+struct alloc_profile
+{
+  size_t interval;
+  ptrdiff_t countdown;
+  Hash_table *sites;
+  FILE *report;
+};
+
+void
+alloc_profile_init (AllocProfile *profile);
+
+void
+alloc_profile_destroy (AllocProfile *profile);
+
+void
+alloc_profile_start (AllocProfile *profile, size_t interval);
+
+void
+alloc_profile_sample (AllocProfile *profile, void const *site, char const *type, size_t bytes);
+
+void
+alloc_profile_write (AllocProfile *profile, FILE *out);
+
+/* Pinning */
+
+/* A pinned object is retained and never moved by a collection until
+   it has been unpinned as often as it has been pinned. */
+typedef struct pin Pin;
+struct pin
+{
+  Object object;
+  size_t count;
+};
+
+/* Memory retained because pinned objects lie in it: a former object
+   stack if START is NULL, and the block between START and END
+   otherwise, which is a former tenured space if TENURED is set. */
+typedef struct retained_region RetainedRegion;
+struct retained_region
+{
+  ObjectStack stack;
+  Pointer start;
+  Pointer end;
+  bool tenured;
+};
+
+/* Survivor spaces */
+
+#define TENURING_THRESHOLD_MAX 16
+
+/* A survivor space holds the objects of one age, that is, which have
+   survived that number of minor collections, between START and FREE.
+   During a collection, those between SCAN and FREE have yet to be
+   scanned. */
+typedef struct survivor_space SurvivorSpace;
+struct survivor_space
+{
+  Pointer start;
+  Pointer scan;
+  Pointer free;
+  Pointer end;
+};
+
 /* Heap */
 
+#define HUGE_PAGE_SIZE (1ULL << 21)
+
+/* New objects are allocated in the nursery and evacuated by each
+   collection.  Those that survive are aged in survivor spaces and
+   eventually promoted into the tenured space, which is itself
+   collected only when it cannot take the survivors of another minor
+   collection. */
 typedef struct heap Heap;
 struct heap
 {
+  /* The tenured space, allocated from START to FREE.  It is resized
+     in place after a full collection and grown before a minor one to
+     take all survivors. */
   Pointer start;
   Pointer free;
+  Pointer end;
+  /* The objects between START and FROZEN are neither moved nor
+     written to by a compaction, which is always done instead of
+     copying while there are any.  They are never reclaimed. */
+  Pointer frozen;
+  /* Bounds of the size of the tenured space in bytes.  Each tenured
+     space lies in a range of HEAP_SIZE bytes of addresses reserved
+     once. */
   size_t heap_size;
+  size_t min_heap_size;
+  /* The part of the tenured space the live data fill after it has
+     been resized. */
+  double occupancy_target;
+  /* The full collections in a row after which the tenured space could
+     have been shrunk.  It is only shrunk once these have reached a
+     limit. */
+  size_t low_occupancy;
+  /* The collections of both generations done at once because the
+     tenured space could not grow any further. */
+  size_t emergencies;
+  /* If set, the next collection collects both generations. */
+  bool full;
+  /* If set, the current minor collection keeps the objects of the
+     nursery in the survivor spaces instead of promoting them. */
+  bool evacuating;
+  /* The bytes allocated on STACK between two minor collections,
+     adapted after each so that pauses stay below PAUSE_TARGET
+     seconds. */
   size_t nursery_size;
-  MutationTable *mutation_table;
+  /* Objects that have survived fewer minor collections than this are
+     not promoted yet. */
+  size_t tenuring_threshold;
+  /* The survivor spaces, indexed by the age of their objects.  During
+     a collection, AGED receives the objects one collection older. */
+  SurvivorSpace survivors[TENURING_THRESHOLD_MAX];
+  SurvivorSpace aged[TENURING_THRESHOLD_MAX];
+  double pause_target;
+  /* When the last collection ended, in seconds. */
+  double mutator_start;
+  VmNurseryStats nursery_stats;
+  /* Records the collections. */
+  GcTelemetry telemetry;
+  /* Samples the allocations. */
+  AllocProfile alloc_profile;
+  /* The words copied or moved by the current collection. */
+  size_t copied;
+  /* The number of threads that copy objects during a collection. */
+  size_t gc_threads;
+  /* If set, the tenured space is compacted in place instead of being
+     copied. */
+  bool compact;
+  /* If set, the compaction is preceded by a marking of the tenured
+     space that proceeds in slices of SLICE_BUDGET seconds after minor
+     collections. */
+  bool incremental;
+  /* If set, a serial collection copies objects in approximately
+     depth-first order and the pairs of a list one after the other. */
+  bool depth_first;
+  /* If set, the ranges of the tenured spaces and the chunks of STACK
+     are aligned to HUGE_PAGE_SIZE and backed by huge pages where the
+     system allows. */
+  bool huge_pages;
+  /* The bytes backed by huge pages as read when COLLECTIONS was
+     HUGE_PAGE_COLLECTION. */
+  size_t huge_page_bytes;
+  size_t huge_page_collection;
+  double slice_budget;
+  /* Not NULL while an incremental marking is in progress. */
+  struct compactor *compactor;
+  /* The collections so far, each of which may move objects. */
+  size_t collections;
+  /* During a collection, the ephemerons whose keys have not been
+     found live yet.  The lock guards them from parallel workers. */
+  STACK(Pointer) ephemerons;
+  pthread_mutex_t ephemeron_lock;
+  /* The registrations of objects with guardians, of which those from
+     GUARDED_YOUNG on have been made since the last collection. */
+  STACK(Object) guarded;
+  ptrdiff_t guarded_young;
+  /* The pinned objects.  Those outside the tenured space stay where
+     they have been allocated, and the nurseries and tenured spaces
+     they lie in are kept in RETAINED. */
+  STACK(Pin) pinned;
+  STACK(RetainedRegion) retained;
+  /* The words of the objects unpinned since the last collection. */
+  size_t unpinned;
+  /* The reserved ranges of addresses not in use by a tenured space,
+     whose memory has been returned to the system. */
+  STACK(Pointer) spaces;
+  CardTable card_table;
+  LargeObjectSpace large_object_space;
   SymbolTable symbol_table;
   ResourceManager resource_manager;
+  /* The nursery, on which C code and compiled code allocate alike. */
   ObjectStack stack;
 };
 
@@ -295,6 +662,12 @@ heap_init (Heap *heap, size_t heap_size);
 void
 heap_destroy (Heap *heap);
 
+void
+heap_use_huge_pages (Heap *heap);
+
+size_t
+heap_huge_page_bytes (Heap *heap);
+
 
 /* Virtual machine */
 struct vm
@@ -308,9 +681,24 @@ struct vm
 void
 collect (Heap *heap, Object roots[], size_t root_count);
 
+void
+heap_share (Heap *heap, Object roots[], size_t root_count);
+
 void
 mutate (Heap *heap, Pointer field, Object value);
 
+void
+mutate_fill (Heap *heap, Pointer fields, size_t count, Object value);
+
+void
+shade (Heap *heap, Object object);
+
+void
+pin (Heap *heap, Object object);
+
+void
+unpin (Heap *heap, Object object);
+
 /* Dumping and loading images */
 
 void
@@ -360,6 +748,12 @@ boolean_value (Object b);
 bool
 is_boolean (Object obj);
 
+Pointer
+alloc_words (Heap *heap, size_t size);
+
+void
+fill_words (Pointer p, size_t count, Object object);
+
 Object
 cons (Heap *heap, Object car, Object cdr);
 
@@ -381,13 +775,25 @@ set_car (Heap *heap, Object pair, Object car);
 void
 set_cdr (Heap *heap, Object pair, Object cdr);
 
+void
+init_car (Object pair, Object car);
+
+void
+init_cdr (Object pair, Object cdr);
+
 bool
 is_pair (Object object);
 
 Object
 make_string (Heap *heap, size_t length, ucs4_t c);
 
-uint32_t *
+Object
+string_from_utf8 (Heap *heap, uint8_t const *s, size_t n);
+
+int
+string_width (Object s);
+
+void *
 string_bytes (Object s);
 
 size_t
@@ -400,7 +806,7 @@ char *
 string_value (Object sym);
 
 void
-string_set (Object string, size_t index, ucs4_t c);
+string_set (Heap *heap, Object string, size_t index, ucs4_t c);
 
 bool
 is_string (Object object);
@@ -429,6 +835,12 @@ symbol_value (Object sym);
 Object
 make_vector (Heap *heap, size_t length, Object object);
 
+Object
+make_vector_uninitialized (Heap *heap, size_t length);
+
+Object
+vector_copy (Heap *heap, Object vector, size_t start, size_t end);
+
 size_t
 vector_length (Object vector);
 
@@ -438,6 +850,12 @@ vector_ref (Object vector, size_t index);
 void
 vector_set (Heap *heap, Object vector, size_t index, Object value);
 
+void
+vector_init_element (Object vector, size_t index, Object value);
+
+void
+vector_fill (Heap *heap, Object vector, Object value, size_t start, size_t end);
+
 bool
 is_vector (Object object);
 
@@ -492,9 +910,61 @@ closure_ref (Object closure, size_t index);
 Object
 closure_set (Heap *heap, Object closure, size_t index, Object val);
 
+void
+closure_init (Object closure, size_t index, Object val);
+
 int
 closure_call (Vm *vm, Object closure, size_t entry_point);
 
+Object
+make_ephemeron (Heap *heap, Object key, Object value);
+
+bool
+is_ephemeron (Object object);
+
+Object
+ephemeron_key (Heap *heap, Object ephemeron);
+
+Object
+ephemeron_value (Heap *heap, Object ephemeron);
+
+void
+ephemeron_set_value (Heap *heap, Object ephemeron, Object value);
+
+bool
+ephemeron_is_broken (Object ephemeron);
+
+/* Weak tables */
+
+Object
+make_weak_table (Heap *heap, size_t size);
+
+Object
+weak_table_ref (Heap *heap, Object table, Object key, Object default_value);
+
+void
+weak_table_set (Heap *heap, Object table, Object key, Object value);
+
+void
+weak_table_delete (Heap *heap, Object table, Object key);
+
+size_t
+weak_table_count (Heap *heap, Object table);
+
+/* Guardians */
+
+Object
+make_guardian (Heap *heap);
+
+bool
+is_guardian (Object object);
+
+void
+guardian_register (Heap *heap, Object guardian, Object object);
+
+Object
+guardian_retrieve (Heap *heap, Object guardian);
+
 /* Runtime */
 bool
 is_list (Object obj);
@@ -625,7 +1095,7 @@ assembly_entry_point_number (Object assembly);
 EntryPoint *
 assembly_entry_points (Object assembly);
 
-extern int (*trampoline) (Vm *vm, void *f, void *heap, void *arg);
+extern int (*trampoline) (Vm *vm, void *f, void *arg);
 
 /* Initial symbols */
 
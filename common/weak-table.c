@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * Thunder is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3, or (at
+ * your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Authors:
+ *      Marc Nieper-Wißkirchen
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "vmcommon.h"
+
+/* A weak table maps keys to values by identity without retaining the
+   keys.  It is a vector holding a bytevector with the state below and
+   a vector of buckets.  Each bucket is a list of ephemerons.  Keys are
+   hashed by address, so the table is rehashed on first use after a
+   collection, which also drops the broken ephemerons. */
+#define TABLE_STATE   0
+#define TABLE_BUCKETS 1
+
+#define STATE_COLLECTIONS 1
+#define STATE_COUNT       2
+
+static Pointer
+table_state (Object table)
+{
+  return (Pointer) vector_ref (table, TABLE_STATE);
+}
+
+static size_t
+hash (Object key, size_t size)
+{
+  return (key / ALIGNMENT) % size;
+}
+
+Object
+make_weak_table (Heap *heap, size_t size)
+{
+  Pointer p = alloc_words (heap, 4);
+  p[0] = BYTEVECTOR_TYPE;
+  p[1] = 2 * WORDSIZE;
+  p[2] = heap->collections;
+  p[3] = 0;
+  Object state = (Object) p | POINTER_TYPE;
+
+  Object table = make_vector (heap, 2, state);
+  vector_set (heap, table, TABLE_BUCKETS, make_vector (heap, size > 0 ? size : 1, make_null ()));
+  return table;
+}
+
+/* Redistribute the live entries of TABLE over SIZE buckets. */
+static void
+rehash (Heap *heap, Object table, size_t size)
+{
+  Object buckets = vector_ref (table, TABLE_BUCKETS);
+  Object cells = make_null ();
+  size_t count = 0;
+  for (size_t i = 0; i < vector_length (buckets); ++i)
+    {
+      Object next;
+      for (Object cell = vector_ref (buckets, i); !is_null (cell); cell = next)
+	{
+	  next = cdr (cell);
+	  if (ephemeron_is_broken (car (cell)))
+	    continue;
+	  set_cdr (heap, cell, cells);
+	  cells = cell;
+	  ++count;
+	}
+    }
+
+  if (size == vector_length (buckets))
+    for (size_t i = 0; i < size; ++i)
+      vector_set (heap, buckets, i, make_null ());
+  else
+    {
+      buckets = make_vector (heap, size, make_null ());
+      vector_set (heap, table, TABLE_BUCKETS, buckets);
+    }
+
+  Object next;
+  for (Object cell = cells; !is_null (cell); cell = next)
+    {
+      next = cdr (cell);
+      size_t i = hash (((Pointer) car (cell))[0], size);
+      set_cdr (heap, cell, vector_ref (buckets, i));
+      vector_set (heap, buckets, i, cell);
+    }
+
+  Pointer state = table_state (table);
+  state[STATE_COLLECTIONS] = heap->collections;
+  state[STATE_COUNT] = count;
+}
+
+static void
+refresh (Heap *heap, Object table)
+{
+  if (table_state (table)[STATE_COLLECTIONS] != heap->collections)
+    rehash (heap, table, vector_length (vector_ref (table, TABLE_BUCKETS)));
+}
+
+/* Return the ephemeron for KEY in TABLE, or the empty list if there
+   is none. */
+static Object
+lookup (Heap *heap, Object table, Object key)
+{
+  refresh (heap, table);
+  Object buckets = vector_ref (table, TABLE_BUCKETS);
+  for (Object cell = vector_ref (buckets, hash (key, vector_length (buckets)));
+       !is_null (cell);
+       cell = cdr (cell))
+    if (((Pointer) car (cell))[0] == key)
+      return car (cell);
+  return make_null ();
+}
+
+Object
+weak_table_ref (Heap *heap, Object table, Object key, Object default_value)
+{
+  Object ephemeron = lookup (heap, table, key);
+  return is_null (ephemeron) ? default_value : ephemeron_value (heap, ephemeron);
+}
+
+void
+weak_table_set (Heap *heap, Object table, Object key, Object value)
+{
+  Object ephemeron = lookup (heap, table, key);
+  if (!is_null (ephemeron))
+    {
+      ephemeron_set_value (heap, ephemeron, value);
+      return;
+    }
+
+  Object buckets = vector_ref (table, TABLE_BUCKETS);
+  size_t size = vector_length (buckets);
+  size_t i = hash (key, size);
+  vector_set (heap, buckets, i,
+	      cons (heap, make_ephemeron (heap, key, value), vector_ref (buckets, i)));
+  Pointer state = table_state (table);
+  if (++state[STATE_COUNT] > 2 * size)
+    rehash (heap, table, 2 * size);
+}
+
+void
+weak_table_delete (Heap *heap, Object table, Object key)
+{
+  refresh (heap, table);
+  Object buckets = vector_ref (table, TABLE_BUCKETS);
+  size_t i = hash (key, vector_length (buckets));
+  Object prev = make_null ();
+  for (Object cell = vector_ref (buckets, i); !is_null (cell); prev = cell, cell = cdr (cell))
+    if (((Pointer) car (cell))[0] == key)
+      {
+	if (is_null (prev))
+	  vector_set (heap, buckets, i, cdr (cell));
+	else
+	  set_cdr (heap, prev, cdr (cell));
+	--table_state (table)[STATE_COUNT];
+	return;
+      }
+}
+
+size_t
+weak_table_count (Heap *heap, Object table)
+{
+  refresh (heap, table);
+  return table_state (table)[STATE_COUNT];
+}
@@ -208,18 +208,15 @@ scheme_write (Object obj, FILE *out)
       else if (is_string (obj))
 	{
 	  fputs ("\"", out);
-	  uint32_t *s = string_bytes (obj);
 	  size_t n = string_length (obj);
-	  while (n > 0)
+	  for (size_t i = 0; i < n; ++i)
 	    {
-	      uint32_t b[2] = { [1] = 0 };
-	      int len = u32_mbtouc_unsafe (&b[0], s, n);
-	      n -= len;
-	      s += len;
+	      uint32_t b[2] = { string_ref (obj, i), 0 };
 	      switch (b[0])
 		{
 		case 0x22:
 		  fputs ("\\\"", out);
+		  break;
 		case 0x5c:
 		  fputs ("\\\\", out);
 		  break;
@@ -21,10 +21,89 @@
 #ifndef LIBTHUNDER_H_INCLUDED
 #define LIBTHUNDER_H_INCLUDED
 
+#include <stdint.h>
 #include <stdio.h>
 
 typedef struct vm Vm;
 
+/* A value of the virtual machine. */
+typedef uintptr_t VmObject;
+
+/* Statistics of the adaptive sizing of the nursery. */
+typedef struct vm_nursery_stats VmNurseryStats;
+struct vm_nursery_stats
+{
+  size_t collections;		/* Number of minor collections.  */
+  size_t size;			/* Current nursery size in bytes.  */
+  size_t min_size;		/* Smallest nursery size chosen.  */
+  size_t max_size;		/* Largest nursery size chosen.  */
+  double survival_ratio;	/* Of the last minor collection.  */
+  double allocation_rate;	/* In bytes per second.  */
+  double pause;			/* Of the last minor collection, in seconds.  */
+  size_t stack_high_water;	/* Most bytes allocated by the runtime
+				   between two collections.  */
+  size_t survivors;		/* Bytes kept in the survivor spaces.  */
+  size_t promoted;		/* Bytes promoted by minor collections.  */
+  size_t premature;		/* Of those, bytes promoted before the
+				   tenuring threshold because a survivor
+				   space was full.  */
+};
+
+/* Kinds of garbage collections. */
+typedef enum vm_gc_kind VmGcKind;
+enum vm_gc_kind
+  {
+    VM_GC_MINOR,		/* Only the nursery was collected.  */
+    VM_GC_MAJOR,		/* The old generation was copied as well.  */
+    VM_GC_COMPACT		/* The old generation was compacted as well.  */
+  };
+
+/* Types of resources, which are freed by the garbage collector. */
+enum
+  {
+    VM_RESOURCE_EXACT_NUMBER,
+    VM_RESOURCE_INEXACT_NUMBER,
+    VM_RESOURCE_ASSEMBLY,
+    VM_RESOURCE_COUNT
+  };
+
+/* Record of a single garbage collection. */
+typedef struct vm_gc_record VmGcRecord;
+struct vm_gc_record
+{
+  VmGcKind kind;
+  double start;			/* Monotonic time in seconds.  */
+  double end;			/* Monotonic time in seconds.  */
+  size_t bytes_before;		/* Nursery and old generation in use.  */
+  size_t bytes_after;		/* Old generation in use afterwards.  */
+  size_t bytes_copied;		/* Copied or moved by the collection.  */
+  size_t resources_freed[VM_RESOURCE_COUNT];
+  size_t remembered_set;	/* Dirty cards scanned for old-to-young
+				   pointers.  */
+  size_t nursery_symbols;	/* Symbols interned since the last
+				   collection.  */
+  size_t heap_symbols;		/* Symbols in the old generation
+				   afterwards.  */
+};
+
+/* Pause times of all garbage collections.  The percentiles are
+   rounded up to the next bucket of a logarithmic histogram with four
+   buckets per doubling. */
+typedef struct vm_gc_stats VmGcStats;
+struct vm_gc_stats
+{
+  size_t collections;
+  double total_pause;		/* In seconds.  */
+  double p50_pause;		/* In seconds.  */
+  double p99_pause;		/* In seconds.  */
+  double max_pause;		/* In seconds.  */
+  size_t huge_page_bytes;	/* Of the heap backed by huge pages.  */
+  size_t heap_size;		/* Current size of the old generation
+				   in bytes.  */
+  size_t emergency_collections;	/* Major collections done because the
+				   old generation could not grow.  */
+};
+
 void
 vm_init (void);
 
@@ -37,4 +116,30 @@ vm_free (Vm *);
 int
 vm_load (Vm *, FILE *, char const *);
 
+void
+vm_nursery_stats (Vm *, VmNurseryStats *);
+
+void
+vm_gc_stats (Vm *, VmGcStats *);
+
+/* Store the records of the last collections, at most as many as
+   given and oldest first, and return their number.  The last 256
+   records are kept. */
+size_t
+vm_gc_records (Vm *, VmGcRecord *, size_t);
+
+/* Write the estimated bytes and objects allocated so far per
+   allocation site and type of object, which are sampled if
+   THUNDER_ALLOC_INTERVAL or THUNDER_ALLOC_PROFILE is set. */
+void
+vm_alloc_profile (Vm *, FILE *);
+
+/* Collect the heap and keep the objects reachable from the given
+   roots in place from now on without writing to them, so that their
+   memory stays shared with processes forked afterwards.  The roots
+   are updated to the new addresses.  The frozen objects are never
+   reclaimed. */
+void
+vm_share (Vm *, VmObject[], size_t);
+
 #endif /* LIBTHUNDER_H_INCLUDED */
@@ -20,9 +20,13 @@
 #if HAVE_CONFIG_H
 # include <config.h>
 #endif
+#include <errno.h>
 #include <libthunder.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "error.h"
+#include "minmax.h"
 #include "vmcommon.h"
 #include "xalloc.h"
 
@@ -36,7 +40,75 @@ Vm *
 vm_create (void)
 {
   Vm *vm = XMALLOC (struct vm);
-  heap_init (&vm->heap, 1ULL << 30);
+  size_t heap_size = 1ULL << 30;
+  char const *max_heap = getenv ("THUNDER_GC_MAX_HEAP");
+  if (max_heap != NULL)
+    heap_size = MAX (strtoul (max_heap, NULL, 10), 1) << 20;
+  heap_init (&vm->heap, heap_size);
+
+  char const *min_heap = getenv ("THUNDER_GC_MIN_HEAP");
+  if (min_heap != NULL)
+    vm->heap.min_heap_size = strtoul (min_heap, NULL, 10) << 20;
+
+  char const *occupancy = getenv ("THUNDER_GC_OCCUPANCY");
+  if (occupancy != NULL)
+    vm->heap.occupancy_target = MIN (MAX (strtod (occupancy, NULL), 1), 100) / 100;
+
+  char const *gc_threads = getenv ("THUNDER_GC_THREADS");
+  if (gc_threads != NULL)
+    vm->heap.gc_threads = MAX (strtoul (gc_threads, NULL, 10), 1);
+
+  char const *compact = getenv ("THUNDER_GC_COMPACT");
+  if (compact != NULL)
+    vm->heap.compact = strcmp (compact, "0") != 0;
+
+  char const *pause_target = getenv ("THUNDER_GC_PAUSE_TARGET");
+  if (pause_target != NULL)
+    vm->heap.pause_target = strtod (pause_target, NULL) / 1000;
+
+  char const *incremental = getenv ("THUNDER_GC_INCREMENTAL");
+  if (incremental != NULL)
+    vm->heap.incremental = strcmp (incremental, "0") != 0;
+
+  char const *depth_first = getenv ("THUNDER_GC_DEPTH_FIRST");
+  if (depth_first != NULL)
+    vm->heap.depth_first = strcmp (depth_first, "0") != 0;
+
+  char const *tenuring_threshold = getenv ("THUNDER_GC_TENURING_THRESHOLD");
+  if (tenuring_threshold != NULL)
+    vm->heap.tenuring_threshold = MIN (MAX (strtoul (tenuring_threshold, NULL, 10), 1),
+				       TENURING_THRESHOLD_MAX);
+
+  char const *huge_pages = getenv ("THUNDER_GC_HUGE_PAGES");
+  if (huge_pages != NULL && strcmp (huge_pages, "0") != 0)
+    heap_use_huge_pages (&vm->heap);
+
+  char const *slice_budget = getenv ("THUNDER_GC_SLICE_BUDGET");
+  if (slice_budget != NULL)
+    vm->heap.slice_budget = strtod (slice_budget, NULL) / 1000;
+
+  char const *alloc_interval = getenv ("THUNDER_ALLOC_INTERVAL");
+  char const *alloc_profile = getenv ("THUNDER_ALLOC_PROFILE");
+  if (alloc_interval != NULL || alloc_profile != NULL)
+    alloc_profile_start (&vm->heap.alloc_profile,
+			 alloc_interval != NULL
+			 ? MAX (strtoul (alloc_interval, NULL, 10), 1)
+			 : ALLOC_PROFILE_INTERVAL);
+  if (alloc_profile != NULL)
+    {
+      vm->heap.alloc_profile.report = fopen (alloc_profile, "w");
+      if (vm->heap.alloc_profile.report == NULL)
+	error (EXIT_FAILURE, errno, "%s", alloc_profile);
+    }
+
+  char const *log = getenv ("THUNDER_GC_LOG");
+  if (log != NULL)
+    {
+      vm->heap.telemetry.log = fopen (log, "a");
+      if (vm->heap.telemetry.log == NULL)
+	error (EXIT_FAILURE, errno, "%s", log);
+    }
+  
   return vm;
 }
 
@@ -57,3 +129,38 @@ vm_load (Vm *vm, FILE *src, char const *filename)
 
   return closure_call (vm, obj, 0);
 }
+
+void
+vm_nursery_stats (Vm *vm, VmNurseryStats *stats)
+{
+  *stats = vm->heap.nursery_stats;
+  stats->stack_high_water = MAX (stats->stack_high_water,
+				 object_stack_size (&vm->heap.stack));
+}
+
+void
+vm_gc_stats (Vm *vm, VmGcStats *stats)
+{
+  gc_telemetry_stats (&vm->heap.telemetry, stats);
+  stats->huge_page_bytes = heap_huge_page_bytes (&vm->heap);
+  stats->heap_size = (vm->heap.end - vm->heap.start) * WORDSIZE;
+  stats->emergency_collections = vm->heap.emergencies;
+}
+
+size_t
+vm_gc_records (Vm *vm, VmGcRecord *records, size_t count)
+{
+  return gc_telemetry_records (&vm->heap.telemetry, records, count);
+}
+
+void
+vm_alloc_profile (Vm *vm, FILE *out)
+{
+  alloc_profile_write (&vm->heap.alloc_profile, out);
+}
+
+void
+vm_share (Vm *vm, Object roots[], size_t count)
+{
+  heap_share (&vm->heap, roots, count);
+}
@@ -1,2 +1,75 @@
 [NAME]
 Thunder - a virtual machine
+
+[ENVIRONMENT]
+.TP
+.B THUNDER_GC_THREADS
+Number of threads the garbage collector uses to copy live objects.
+Defaults to 1, which selects the sequential collector.
+.TP
+.B THUNDER_GC_COMPACT
+If set to a value other than 0, the old generation is compacted in
+place instead of being copied into a fresh space, which halves the
+memory needed during a major garbage collection.
+.TP
+.B THUNDER_GC_INCREMENTAL
+If set to a value other than 0, the live objects of the old
+generation are marked in slices following the minor garbage
+collections, so that only the compaction of the old generation
+remains a longer pause.
+.TP
+.B THUNDER_GC_SLICE_BUDGET
+Time in milliseconds an incremental marking slice may take.
+Defaults to 1.
+.TP
+.B THUNDER_GC_DEPTH_FIRST
+If set to 0, the sequential collector copies live objects in
+breadth-first order instead of approximately depth-first, which
+keeps the pairs of a list next to each other.
+.TP
+.B THUNDER_GC_TENURING_THRESHOLD
+Number of minor collections an object has to survive before it is
+promoted into the old generation, between 1 and 16.  Until then, it
+is kept in a survivor space.  Defaults to 2.
+.TP
+.B THUNDER_GC_MAX_HEAP
+Size in MiB the old generation may grow to.  Defaults to 1024.
+.TP
+.B THUNDER_GC_MIN_HEAP
+Size in MiB below which the old generation is not shrunk.  Defaults
+to 0.
+.TP
+.B THUNDER_GC_OCCUPANCY
+Percentage of the old generation the live objects should fill after
+a major garbage collection.  The old generation is grown at once to
+meet it, but shrunk only when it has been too large for several
+major collections in a row.  Defaults to 50.
+.TP
+.B THUNDER_GC_HUGE_PAGES
+If set to a value other than 0, the heap and the nursery are backed
+by transparent huge pages of 2 MiB where the system allows.
+.TP
+.B THUNDER_GC_LOG
+Name of a file to which a line of JSON is appended for each garbage
+collection.  It records the kind of the collection, its start and
+end in seconds of monotonic time, the bytes in use before and after,
+the bytes copied, the resources freed, the number of dirty cards
+scanned and the sizes of the symbol tables.
+.TP
+.B THUNDER_ALLOC_INTERVAL
+If set, an allocation is sampled each time this number of bytes has
+been allocated by compiled code or the runtime.  Each sample records
+the entry point of the compiled code or the return address of the
+allocating function of the runtime, and the type of the objects.
+.TP
+.B THUNDER_ALLOC_PROFILE
+Name of a file to which the sampled allocations are written on exit,
+as the estimated bytes and objects allocated per site and type, most
+bytes first.  Allocations are sampled every 65536 bytes unless
+.B THUNDER_ALLOC_INTERVAL
+is set.
+.TP
+.B THUNDER_GC_PAUSE_TARGET
+Pause time in milliseconds that minor garbage collections should not
+exceed.  The nursery is resized after each minor collection to meet
+it.  Defaults to 10.
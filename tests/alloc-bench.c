@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* Measure the rate at which the runtime allocates garbage on the
+   object stack, including the minor collections it takes.  The best
+   of five runs is printed in millions of objects per second. */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <time.h>
+
+#include "vmcommon.h"
+
+#define RUNS 5
+
+static Heap heap;
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Collect the garbage as compiled code would at its next
+   allocation. */
+static void
+safe_point (void)
+{
+  if (object_stack_is_full (&heap.stack))
+    collect (&heap, NULL, 0);
+}
+
+static double
+bench_cons (size_t count)
+{
+  double start = now ();
+  for (size_t i = 0; i < count; ++i)
+    {
+      cons (&heap, make_char ('a'), make_null ());
+      safe_point ();
+    }
+  return now () - start;
+}
+
+static double
+bench_vector (size_t count)
+{
+  double start = now ();
+  for (size_t i = 0; i < count; ++i)
+    {
+      make_vector (&heap, 8, make_null ());
+      safe_point ();
+    }
+  return now () - start;
+}
+
+static double
+bench_string (size_t count)
+{
+  double start = now ();
+  for (size_t i = 0; i < count; ++i)
+    {
+      make_string (&heap, 16, 'x');
+      safe_point ();
+    }
+  return now () - start;
+}
+
+int
+main (int argc, char *argv)
+{
+  init ();
+  heap_init (&heap, 1ULL << 30);
+
+  struct
+  {
+    char const *name;
+    double (*run) (size_t);
+    size_t count;
+    double best;
+  } benches[] =
+      {
+	{ "cons", bench_cons, 50000000, 0 },
+	{ "vector 8", bench_vector, 2000000, 0 },
+	{ "string 16", bench_string, 2000000, 0 }
+      };
+  size_t const bench_count = sizeof benches / sizeof benches[0];
+
+  for (int i = 0; i < RUNS; ++i)
+    for (size_t j = 0; j < bench_count; ++j)
+      {
+	double time = benches[j].run (benches[j].count);
+	if (i == 0 || time < benches[j].best)
+	  benches[j].best = time;
+      }
+
+  for (size_t j = 0; j < bench_count; ++j)
+    printf ("%-10s %6.1f M/s\n", benches[j].name,
+	    benches[j].count / benches[j].best / 1e6);
+
+  heap_destroy (&heap);
+}
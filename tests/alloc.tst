@@ -0,0 +1,37 @@
+(closure
+ (code
+  `((entry)
+    (movr %v2 %r0)
+    (movi %v0 $null)
+    (movi %v1 0)
+    loop
+    (beqi walk %v1 1000000)
+    (alloc 4 %v0 %v2)
+    (movi %r0 $true)
+    (mov %r0 (cons %r0 %r0))
+    (mov %v0 (cons %v0 %v0))
+    (addi %v1 %v1 1)
+    (jmpi loop)
+    walk
+    (b next (pair? %v0))
+    (beqi done %v0 $null)
+    (jmpi fail)
+    next
+    (mov %r0 (car %v0))
+    (mov %r1 (cdr %v0))
+    (bner fail %r0 %r1)
+    (movr %v0 %r1)
+    (subi %v1 %v1 1)
+    (jmpi walk)
+    fail
+    (movi %r0 "fail")
+    (jmpi print)
+    done
+    (bnei fail %v1 0)
+    (movi %r0 "ok")
+    print
+    (prepare)
+    (pushargr %r0)
+    (finishi &puts)
+    (movi %r0 0)
+    (ret))))
@@ -23,6 +23,7 @@
 #endif
 #include <locale.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "assert.h"
 #include "localcharset.h"
@@ -53,6 +54,83 @@ read_string (uint8_t *b)
   return obj;
 }
 
+/* Load and run PROGRAM in VM. */
+static void
+run (Vm *vm, char const *program)
+{
+  FILE *in = fmemopen ((void *) program, strlen (program), "r");
+  ASSERT (vm_load (vm, in, "program") == 0);
+  fclose (in);
+}
+
+/* Once the runtime has filled the object stack, compiled code
+   collects at its next allocation. */
+static void
+test_full_stack (void)
+{
+  Vm *vm = vm_create ();
+  while (!object_stack_is_full (&vm->heap.stack))
+    cons (&vm->heap, make_null (), make_null ());
+
+  run (vm,
+       "(closure\n"
+       " (code\n"
+       "  `((entry)\n"
+       "    (movr %v2 %r0)\n"
+       "    (alloc 2 %v2)\n"
+       "    (movi %r0 $null)\n"
+       "    (mov %r0 (cons %r0 %r0))\n"
+       "    (movi %r0 0)\n"
+       "    (ret))))\n");
+
+  VmNurseryStats stats;
+  vm_nursery_stats (vm, &stats);
+  ASSERT (stats.collections == 1);
+
+  vm_free (vm);
+}
+
+/* Allocations of compiled code are sampled as well. */
+static void
+test_alloc_profile (void)
+{
+  Vm *vm = vm_create ();
+  alloc_profile_start (&vm->heap.alloc_profile, 64);
+
+  run (vm,
+       "(closure\n"
+       " (code\n"
+       "  `((entry)\n"
+       "    (movr %v2 %r0)\n"
+       "    (movi %v1 0)\n"
+       "    loop\n"
+       "    (beqi done %v1 1000)\n"
+       "    (alloc 2 %v2)\n"
+       "    (movi %r0 $null)\n"
+       "    (mov %r0 (cons %r0 %r0))\n"
+       "    (addi %v1 %v1 1)\n"
+       "    (jmpi loop)\n"
+       "    done\n"
+       "    (movi %r0 0)\n"
+       "    (ret))))\n");
+
+  char *report;
+  size_t size;
+  FILE *out = open_memstream (&report, &size);
+  vm_alloc_profile (vm, out);
+  fclose (out);
+
+  /* The 16000 bytes are estimated to within one interval. */
+  size_t bytes = 0;
+  for (char *line = strtok (report, "\n"); line != NULL; line = strtok (NULL, "\n"))
+    if (strstr (line, " compiled ") != NULL)
+      ASSERT (sscanf (line, "%zu", &bytes) == 1);
+  ASSERT (bytes > 16000 - 64 && bytes < 16000 + 64);
+
+  free (report);
+  vm_free (vm);
+}
+
 int
 main (int argc, char *argv)
 {
@@ -72,4 +150,7 @@ main (int argc, char *argv)
   ASSERT (is_assembly (obj));
 
   heap_destroy (&heap);  
+
+  test_full_stack ();
+  test_alloc_profile ();
 }
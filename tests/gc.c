@@ -22,10 +22,43 @@
 # include <config.h>
 #endif
 #include <gmp.h>
+#include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "vmcommon.h"
 #include "macros.h"
+#include "xalloc.h"
+
+static bool
+transparent_huge_pages (void)
+{
+  return access ("/sys/kernel/mm/transparent_hugepage", F_OK) == 0;
+}
+
+/* Return true if the mapping that holds ADDRESS has been advised to
+   be backed by huge pages. */
+static bool
+is_advised_huge (void *address)
+{
+  FILE *smaps = fopen ("/proc/self/smaps", "r");
+  if (smaps == NULL)
+    return false;
+  bool found = false, advised = false;
+  char line[512];
+  while (fgets (line, sizeof line, smaps) != NULL)
+    {
+      uintptr_t start, end;
+      if (sscanf (line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2)
+	found = start <= (uintptr_t) address && (uintptr_t) address < end;
+      else if (found && strncmp (line, "VmFlags:", 8) == 0)
+	advised = strstr (line, " hg") != NULL;
+    }
+  fclose (smaps);
+  return advised;
+}
 
 int
 main (int argc, char *argv)
@@ -35,7 +68,7 @@ main (int argc, char *argv)
   Heap heap;
   heap_init (&heap, 1ULL << 24);
 
-  Object r[4];
+  Object r[5];
   
   Object s = SYMBOL(QUOTE);
   
@@ -88,5 +121,748 @@ main (int argc, char *argv)
   ASSERT (mpq_cmp_si (*z, 0, 1) == 0);  
   mpq_clear (num);
 
+  Object v = make_vector (&heap, 1000, make_null ());
+  r[0] = v;
+  collect (&heap, r, 1);
+  v = r[0];
+  VmGcRecord record;
+  ASSERT (gc_telemetry_records (&heap.telemetry, &record, 1) == 1);
+  ASSERT (record.resources_freed[VM_RESOURCE_EXACT_NUMBER] >= 1);
+  ASSERT (record.bytes_copied >= 1000 * WORDSIZE);
+  vector_set (&heap, v, 0, cons (&heap, make_char ('f'), make_null ()));
+  vector_set (&heap, v, 999, cons (&heap, make_char ('g'), make_null ()));
+  r[0] = v;
+  collect (&heap, r, 1);
+  v = r[0];
+  make_vector (&heap, 8, make_char ('h'));
+  ASSERT (car (vector_ref (v, 0)) == make_char ('f'));
+  ASSERT (car (vector_ref (v, 999)) == make_char ('g'));
+  ASSERT (is_null (vector_ref (v, 500)));
+
+  /* A list that does not fit into the survivor space would be split
+     between it and the tenured space. */
+  heap.tenuring_threshold = 1;
+  for (int j = 0; j < 50; ++j)
+    {
+      p = make_null ();
+      for (int i = 0; i < 10000; ++i)
+	p = cons (&heap, make_char (i % 128), p);
+      r[0] = p; r[1] = v;
+      collect (&heap, r, 2);
+      p = r[0]; v = r[1];
+    }
+  ASSERT ((heap.end - heap.start) * WORDSIZE < heap.heap_size);
+  for (int i = 9999; i >= 0; --i, p = cdr (p))
+    {
+      ASSERT (car (p) == make_char (i % 128));
+      /* The pairs of the list have been copied one after the other. */
+      ASSERT (i == 0 || (Pointer) cdr (p) == (Pointer) p + 2);
+    }
+  ASSERT (car (vector_ref (v, 999)) == make_char ('g'));
+
+  /* The nursery is only grown if the pauses stay below the target. */
+  heap.pause_target = 1;
+  size_t nursery_size = heap.nursery_size;
+  for (int j = 0; j < 10; ++j)
+    {
+      for (int i = 0; i < 10000; ++i)
+	cons (&heap, make_char ('i'), make_null ());
+      collect (&heap, r, 0);
+    }
+  ASSERT (heap.nursery_size > nursery_size);
+  ASSERT (heap.nursery_size % 0x10000 == 0);
+  ASSERT (heap.nursery_stats.max_size == heap.nursery_size);
+  ASSERT (heap.nursery_stats.survival_ratio < 0.1);
+
+  v = make_vector (&heap, 10000, make_null ());
+  r[0] = v;
+  collect (&heap, r, 1);
+  ASSERT (r[0] == v);
+  vector_set (&heap, v, 9999, cons (&heap, make_char ('j'), make_null ()));
+  collect (&heap, r, 1);
+  make_vector (&heap, 8, make_char ('h'));
+  ASSERT (car (vector_ref (v, 9999)) == make_char ('j'));
+  ASSERT (is_null (vector_ref (v, 0)));
+
+  /* A young object filled into a range of an old vector is remembered
+     across all cards of the range. */
+  vector_fill (&heap, v, cons (&heap, make_char ('l'), make_null ()), 100, 3000);
+  r[1] = make_vector_uninitialized (&heap, 3);
+  for (int i = 0; i < 3; ++i)
+    vector_init_element (r[1], i, make_char ('m' + i));
+  collect (&heap, r, 2);
+  make_vector (&heap, 8, make_char ('h'));
+  ASSERT (car (vector_ref (v, 2999)) == make_char ('l'));
+  ASSERT (vector_ref (v, 100) == vector_ref (v, 2999));
+  ASSERT (is_null (vector_ref (v, 99)) && is_null (vector_ref (v, 3000)));
+  ASSERT (vector_ref (r[1], 2) == make_char ('o'));
+  Object copy = vector_copy (&heap, v, 2990, 3010);
+  ASSERT (vector_length (copy) == 20);
+  ASSERT (vector_ref (copy, 9) == vector_ref (v, 2999) && is_null (vector_ref (copy, 10)));
+  /* A long copy lies in the large object space, from which the young
+     objects it refers to are remembered. */
+  vector_set (&heap, v, 5000, cons (&heap, make_char ('n'), make_null ()));
+  r[1] = vector_copy (&heap, v, 0, 10000);
+  ASSERT (large_object_space_contains (&heap.large_object_space, (Pointer) r[1]));
+  collect (&heap, r, 2);
+  collect (&heap, r, 2);
+  ASSERT (car (vector_ref (r[1], 5000)) == make_char ('n'));
+  ASSERT (car (vector_ref (r[1], 2999)) == make_char ('l'));
+
+  /* A tenured string that has been widened refers to its young
+     characters, which are kept by minor, major and compacting
+     collections. */
+  r[1] = make_string (&heap, 3, 'x');
+  collect (&heap, r, 2);
+  string_set (&heap, r[1], 1, 0x3b1);
+  collect (&heap, r, 2);
+  make_string (&heap, 8, 0x3b2);
+  ASSERT (string_width (r[1]) == 2);
+  ASSERT (string_ref (r[1], 0) == 'x' && string_ref (r[1], 1) == 0x3b1);
+  heap.full = true;
+  collect (&heap, r, 2);
+  heap.compact = true;
+  collect (&heap, r, 2);
+  heap.compact = heap.full = false;
+  ASSERT (string_width (r[1]) == 2 && string_length (r[1]) == 3);
+  ASSERT (string_ref (r[1], 0) == 'x' && string_ref (r[1], 1) == 0x3b1
+	  && string_ref (r[1], 2) == 'x');
+  size_t top = heap.large_object_space.top;
+  make_string (&heap, 40000, 'k');
+  ASSERT (heap.large_object_space.top > top);
+  collect (&heap, r, 1);
+  ASSERT (heap.large_object_space.top == top);
+
+  p = make_null ();
+  for (int i = 0; i < 40000; ++i)
+    p = cons (&heap, make_char ('l'), p);
+  r[0] = string (&heap, p);
+  collect (&heap, r, 1);
+  ASSERT (large_object_space_contains (&heap.large_object_space, (Pointer) r[0]));
+  ASSERT (string_ref (r[0], 39999) == 'l');
+  /* A large string keeps its characters across minor, major and
+     compacting collections once it has been widened. */
+  string_set (&heap, r[0], 20000, 0x3b1);
+  for (int j = 0; j < 3; ++j)
+    {
+      heap.full = j > 0;
+      heap.compact = j > 1;
+      collect (&heap, r, 1);
+      ASSERT (string_width (r[0]) == 2 && string_length (r[0]) == 40000);
+      for (int i = 0; i < 40000; ++i)
+	ASSERT (string_ref (r[0], i) == (i == 20000 ? 0x3b1 : 'l'));
+    }
+  heap.compact = heap.full = false;
+
+  /* The second ephemeron and its key are only reachable through the
+     value of the first one; the value of the third one refers to its
+     own key. */
+  r[0] = cons (&heap, make_char ('o'), make_null ());
+  q = cons (&heap, make_char ('p'), make_null ());
+  p = make_ephemeron (&heap, q, make_char ('q'));
+  r[1] = make_ephemeron (&heap, r[0], cons (&heap, q, p));
+  p = cons (&heap, make_char ('r'), make_null ());
+  r[2] = make_ephemeron (&heap, p, cons (&heap, p, make_null ()));
+  r[3] = make_ephemeron (&heap, cons (&heap, make_char ('s'), make_null ()), make_char ('t'));
+  collect (&heap, r, 4);
+  ASSERT (!ephemeron_is_broken (r[1]));
+  ASSERT (ephemeron_key (&heap, r[1]) == r[0]);
+  q = ephemeron_value (&heap, r[1]);
+  ASSERT (!ephemeron_is_broken (cdr (q)));
+  ASSERT (ephemeron_key (&heap, cdr (q)) == car (q));
+  ASSERT (ephemeron_value (&heap, cdr (q)) == make_char ('q'));
+  ASSERT (ephemeron_is_broken (r[2]));
+  ASSERT (ephemeron_is_broken (r[3]));
+  ASSERT (is_undefined (ephemeron_value (&heap, r[3])));
+
+  /* Make an old ephemeron refer to a young value. */
+  ephemeron_set_value (&heap, r[1], cons (&heap, make_char ('u'), make_null ()));
+  collect (&heap, r, 2);
+  ASSERT (car (ephemeron_value (&heap, r[1])) == make_char ('u'));
+
+  r[0] = make_weak_table (&heap, 16);
+  r[1] = make_vector (&heap, 500, make_null ());
+  for (int i = 0; i < 1000; ++i)
+    {
+      p = cons (&heap, make_char (i % 128), make_null ());
+      if (i % 2 == 0)
+	vector_set (&heap, r[1], i / 2, p);
+      weak_table_set (&heap, r[0], p, cons (&heap, p, make_char (i % 128)));
+    }
+  ASSERT (weak_table_count (&heap, r[0]) == 1000);
+  collect (&heap, r, 2);
+  ASSERT (weak_table_count (&heap, r[0]) == 500);
+  for (int i = 0; i < 500; ++i)
+    {
+      p = vector_ref (r[1], i);
+      q = weak_table_ref (&heap, r[0], p, make_null ());
+      ASSERT (car (q) == p);
+      ASSERT (cdr (q) == make_char (2 * i % 128));
+    }
+  weak_table_delete (&heap, r[0], vector_ref (r[1], 0));
+  ASSERT (is_null (weak_table_ref (&heap, r[0], vector_ref (r[1], 0), make_null ())));
+  ASSERT (weak_table_count (&heap, r[0]) == 499);
+
+  /* The unreachable objects registered with a guardian are queued in
+     it.  The registrations with dead guardians are dropped. */
+  r[0] = make_guardian (&heap);
+  r[1] = make_vector (&heap, 50, make_null ());
+  for (int i = 0; i < 100; ++i)
+    {
+      p = cons (&heap, make_char (i), make_null ());
+      if (i % 2 == 0)
+	vector_set (&heap, r[1], i / 2, p);
+      guardian_register (&heap, r[0], p);
+      guardian_register (&heap, make_guardian (&heap), p);
+    }
+  collect (&heap, r, 2);
+  bool seen[100] = { false };
+  for (int i = 0; i < 50; ++i)
+    {
+      p = guardian_retrieve (&heap, r[0]);
+      ASSERT (is_pair (p));
+      uint32_t c = char_value (car (p));
+      ASSERT (c % 2 == 1 && !seen[c]);
+      seen[c] = true;
+    }
+  ASSERT (guardian_retrieve (&heap, r[0]) == make_boolean (false));
+
+  VmGcStats stats;
+  gc_telemetry_stats (&heap.telemetry, &stats);
+  ASSERT (stats.collections == heap.collections);
+  ASSERT (stats.p50_pause <= stats.p99_pause);
+  ASSERT (stats.p99_pause <= stats.max_pause);
+
+  heap_destroy (&heap);
+
+  heap_init (&heap, 1ULL << 24);
+  heap.compact = true;
+  /* Keep the nursery at its minimum size. */
+  heap.pause_target = 0;
+
+  p = make_null ();
+  for (int i = 0; i < 100000; ++i)
+    p = cons (&heap, make_char ('m'), p);
+  r[0] = p;
+  r[1] = make_null ();
+  r[3] = cons (&heap, make_char ('v'), make_null ());
+  r[2] = make_ephemeron (&heap, r[3], cons (&heap, r[3], make_null ()));
+  r[4] = make_guardian (&heap);
+  collect (&heap, r, 5);
+  Pointer start = heap.start;
+  size_t used = heap.free - heap.start;
+  /* The key of this ephemeron dies in the first round, and so does
+     its value, which refers to a resource, in the next major
+     collection. */
+  mpq_init (num);
+  mpq_set_si (num, 3, 1);
+  q = make_exact_number (&heap, num);
+  mpq_clear (num);
+  guardian_register (&heap, r[4], q);
+  q = cons (&heap, q, make_null ());
+  guardian_register (&heap, r[4], q);
+  r[1] = make_ephemeron (&heap, r[0], q);
+  for (int j = 0; j < 100; ++j)
+    {
+      p = make_null ();
+      for (int i = 0; i < 2000; ++i)
+	{
+	  v = make_vector (&heap, 2, make_char (i % 128));
+	  vector_set (&heap, v, 1, make_symbol (&heap, u8"sym4", strlen (u8"sym4")));
+	  p = cons (&heap, v, p);
+	}
+      r[0] = p;
+      collect (&heap, r, 5);
+      p = r[0];
+    }
+  ASSERT (heap.start == start);
+  ASSERT (heap.free - heap.start < used);
+  VmGcRecord records[GC_RECORDS];
+  size_t count = gc_telemetry_records (&heap.telemetry, records, GC_RECORDS);
+  ASSERT (count == heap.collections);
+  for (size_t i = 0; i < count && records[i].kind != VM_GC_COMPACT; ++i)
+    ASSERT (i + 1 < count);
+  ASSERT (ephemeron_is_broken (r[1]));
+  ASSERT (ephemeron_key (&heap, r[2]) == r[3]);
+  ASSERT (car (ephemeron_value (&heap, r[2])) == r[3]);
+  q = guardian_retrieve (&heap, r[4]);
+  v = guardian_retrieve (&heap, r[4]);
+  if (is_pair (v))
+    {
+      Object t = q;
+      q = v;
+      v = t;
+    }
+  ASSERT (car (q) == v);
+  ASSERT (mpq_cmp_si (*exact_number_value (v), 3, 1) == 0);
+  ASSERT (guardian_retrieve (&heap, r[4]) == make_boolean (false));
+  sym1 = make_symbol (&heap, u8"sym4", strlen (u8"sym4"));
+  for (int i = 1999; i >= 0; --i, p = cdr (p))
+    {
+      ASSERT (vector_ref (car (p), 0) == make_char (i % 128));
+      ASSERT (vector_ref (car (p), 1) == sym1);
+    }
+  ASSERT (is_null (p));
+
+  heap_destroy (&heap);
+
+  heap_init (&heap, 1ULL << 24);
+  heap.incremental = true;
+  heap.slice_budget = 0;
+  heap.pause_target = 0;
+
+  p = make_null ();
+  for (int i = 0; i < 100000; ++i)
+    p = cons (&heap, make_char (i % 128), p);
+  r[0] = p;
+  collect (&heap, r, 1);
+  while (heap.compactor == NULL)
+    {
+      r[1] = make_null ();
+      for (int i = 0; i < 10000; ++i)
+	r[1] = cons (&heap, make_char ('n'), r[1]);
+      collect (&heap, r, 2);
+    }
+  /* Move the tail of the list into its head once the slices have
+     traced the latter. */
+  for (int j = 0; j < 50; ++j)
+    collect (&heap, r, 1);
+  ASSERT (heap.compactor != NULL);
+  q = r[0];
+  for (int i = 0; i < 50000; ++i)
+    q = cdr (q);
+  p = cdr (q);
+  set_cdr (&heap, q, make_null ());
+  set_car (&heap, r[0], p);
+  while (heap.compactor != NULL)
+    {
+      for (int i = 0; i < 10000; ++i)
+	cons (&heap, make_char ('n'), make_null ());
+      collect (&heap, r, 1);
+    }
+  p = cdr (r[0]);
+  for (int i = 99998; i >= 49999; --i, p = cdr (p))
+    ASSERT (car (p) == make_char (i % 128));
+  ASSERT (is_null (p));
+  p = car (r[0]);
+  for (int i = 49998; i >= 0; --i, p = cdr (p))
+    ASSERT (car (p) == make_char (i % 128));
+  ASSERT (is_null (p));
+
+  heap_destroy (&heap);
+
+  heap_init (&heap, 1ULL << 24);
+  heap.gc_threads = 4;
+
+  p = make_null ();
+  for (int i = 0; i < 10000; ++i)
+    {
+      v = make_vector (&heap, 3, make_char (i % 128));
+      vector_set (&heap, v, 1, cons (&heap, make_char ('x'), make_null ()));
+      vector_set (&heap, v, 2, make_symbol (&heap, u8"sym1", strlen (u8"sym1")));
+      p = cons (&heap, v, p);
+    }
+  r[0] = p;
+  /* Chains of ephemerons, each keyed by the value of the previous one,
+     need several rounds to be resolved.  Only the first chain has a
+     live start. */
+  r[1] = r[3] = make_null ();
+  r[2] = q = cons (&heap, make_char ('y'), make_null ());
+  p = cons (&heap, make_char ('y'), make_null ());
+  for (int i = 0; i < 1000; ++i)
+    {
+      Object k = cons (&heap, make_char ('z'), make_null ());
+      r[1] = cons (&heap, make_ephemeron (&heap, q, k), r[1]);
+      q = k;
+      k = cons (&heap, make_char ('z'), make_null ());
+      r[3] = cons (&heap, make_ephemeron (&heap, p, k), r[3]);
+      p = k;
+    }
+  collect (&heap, r, 4);
+  for (p = r[1]; !is_null (p); p = cdr (p))
+    ASSERT (!ephemeron_is_broken (car (p)));
+  for (p = r[3]; !is_null (p); p = cdr (p))
+    ASSERT (ephemeron_is_broken (car (p)));
+  p = r[0];
+  sym1 = make_symbol (&heap, u8"sym1", strlen (u8"sym1"));
+  for (int i = 9999; i >= 0; --i, p = cdr (p))
+    {
+      v = car (p);
+      ASSERT (is_vector (v));
+      ASSERT (vector_ref (v, 0) == make_char (i % 128));
+      ASSERT (car (vector_ref (v, 1)) == make_char ('x'));
+      ASSERT (vector_ref (v, 2) == sym1);
+    }
+  ASSERT (is_null (p));
+
+  heap_destroy (&heap);
+
+  heap_init (&heap, 1ULL << 24);
+  heap.compact = true;
+  heap.pause_target = 0;
+
+  /* A young string referenced by a tenured pair and a tenured vector
+     referring to a young pair are pinned, the latter twice. */
+  Object w = make_string (&heap, 10, 'w');
+  void *bytes = string_bytes (w);
+  pin (&heap, w);
+  r[0] = cons (&heap, make_vector (&heap, 2, make_char ('p')), make_null ());
+  collect (&heap, r, 1);
+  v = car (r[0]);
+  pin (&heap, v);
+  pin (&heap, v);
+  vector_set (&heap, v, 1, cons (&heap, make_char ('q'), make_null ()));
+  set_cdr (&heap, r[0], cons (&heap, w, make_null ()));
+  for (int j = 0; j < 30; ++j)
+    {
+      p = make_null ();
+      for (int i = 0; i < 2000; ++i)
+	p = cons (&heap, make_vector (&heap, 2, make_char (i % 128)), p);
+      r[1] = p;
+      collect (&heap, r, 2);
+    }
+  /* The tenured space is compacted around the pinned vector. */
+  count = gc_telemetry_records (&heap.telemetry, records, GC_RECORDS);
+  for (size_t i = 0; i < count && records[i].kind != VM_GC_COMPACT; ++i)
+    ASSERT (i + 1 < count && records[i].kind != VM_GC_MAJOR);
+  ASSERT (car (r[0]) == v);
+  ASSERT (vector_ref (v, 0) == make_char ('p'));
+  ASSERT (car (vector_ref (v, 1)) == make_char ('q'));
+  ASSERT (car (cdr (r[0])) == w);
+  ASSERT (string_bytes (w) == bytes);
+  ASSERT (!stack_is_empty (&heap.retained));
+
+  /* Once unpinned, the objects are moved, and the memory they were
+     kept in is released. */
+  unpin (&heap, w);
+  unpin (&heap, v);
+  collect (&heap, r, 2);
+  w = car (cdr (r[0]));
+  ASSERT (string_bytes (w) != bytes);
+  for (int i = 0; i < 10; ++i)
+    ASSERT (string_ref (w, i) == 'w');
+  ASSERT (car (r[0]) == v);
+  unpin (&heap, v);
+  collect (&heap, r, 2);
+  ASSERT (stack_is_empty (&heap.retained));
+  v = car (r[0]);
+  ASSERT (vector_ref (v, 0) == make_char ('p'));
+  ASSERT (car (vector_ref (v, 1)) == make_char ('q'));
+
+  heap_destroy (&heap);
+
+  /* Successive tenured spaces take turns in two ranges of reserved
+     addresses, which are aligned to huge pages. */
+  heap_init (&heap, 1ULL << 24);
+  heap_use_huge_pages (&heap);
+  /* The initial tenured space is advised as well. */
+  ASSERT (!transparent_huge_pages () || is_advised_huge (heap.start));
+  Pointer spaces[2] = { heap.start, NULL };
+  size_t majors = 0;
+  r[0] = make_null ();
+  for (int j = 0; majors < 4; ++j)
+    {
+      for (int i = 0; i < 2000; ++i)
+	r[0] = cons (&heap, make_char (i % 128), j % 8 == 0 ? make_null () : r[0]);
+      /* The object stack is backed by huge pages from the first
+	 collection on. */
+      ASSERT (j == 0 || (uintptr_t) heap.stack.chunk % HUGE_PAGE_SIZE == 0);
+      Pointer start = heap.start;
+      collect (&heap, r, 1);
+      if (heap.start != start)
+	{
+	  if (spaces[1] == NULL)
+	    spaces[1] = heap.start;
+	  ASSERT (heap.start == spaces[majors++ % 2 == 0 ? 1 : 0]);
+	  ASSERT (stack_size (&heap.spaces) == 1);
+	  ASSERT ((uintptr_t) heap.start % HUGE_PAGE_SIZE == 0);
+	}
+    }
+
+  heap_destroy (&heap);
+
+  /* Allocation on the object stack is limited by the nursery size. */
+  heap_init (&heap, 1ULL << 24);
+  r[0] = make_null ();
+  while (!object_stack_is_full (&heap.stack))
+    r[0] = cons (&heap, make_char ('s'), r[0]);
+  size_t stack_bytes = object_stack_size (&heap.stack);
+  ASSERT (stack_bytes >= heap.nursery_size);
+  ASSERT (stack_bytes < heap.nursery_size + 2 * WORDSIZE);
+  ASSERT (!object_stack_reserve (&heap.stack, 2));
+  collect (&heap, r, 1);
+  ASSERT (!object_stack_is_full (&heap.stack));
+  ASSERT (object_stack_size (&heap.stack) == 0);
+  ASSERT (object_stack_reserve (&heap.stack, 2));
+  ASSERT (heap.stack.limit - heap.stack.free >= 2);
+  ASSERT (heap.nursery_stats.stack_high_water == stack_bytes);
+
+  heap_destroy (&heap);
+
+  /* Objects are promoted once they have survived the tenuring
+     threshold of minor collections.  Until then, tenured objects may
+     refer to them. */
+  heap_init (&heap, 1ULL << 24);
+  heap.tenuring_threshold = 3;
+  heap.pause_target = 0;
+  r[0] = make_vector (&heap, 2, make_null ());
+  for (int i = 1; i < 3; ++i)
+    {
+      collect (&heap, r, 1);
+      ASSERT ((Pointer) r[0] >= heap.survivors[i].start
+	      && (Pointer) r[0] < heap.survivors[i].free);
+    }
+  collect (&heap, r, 1);
+  v = r[0];
+  ASSERT ((Pointer) v >= heap.start && (Pointer) v < heap.free);
+  vector_set (&heap, v, 0, cons (&heap, make_char ('a'), make_null ()));
+  for (int i = 1; i < 3; ++i)
+    {
+      collect (&heap, r, 1);
+      p = vector_ref (v, 0);
+      ASSERT ((Pointer) p >= heap.survivors[i].start
+	      && (Pointer) p < heap.survivors[i].free);
+      ASSERT (car (p) == make_char ('a'));
+    }
+  collect (&heap, r, 1);
+  p = vector_ref (v, 0);
+  ASSERT ((Pointer) p >= heap.start && (Pointer) p < heap.free);
+  ASSERT (heap.nursery_stats.premature == 0);
+
+  /* Survivors that do not fit are promoted prematurely. */
+  size_t promoted = heap.nursery_stats.promoted;
+  p = make_null ();
+  for (size_t i = 0; i < heap.nursery_size / (2 * WORDSIZE); ++i)
+    p = cons (&heap, make_char ('b'), p);
+  r[0] = p;
+  collect (&heap, r, 1);
+  ASSERT (heap.nursery_stats.premature > 0);
+  ASSERT (heap.nursery_stats.promoted - promoted >= heap.nursery_stats.premature);
+  ASSERT (heap.nursery_stats.survivors > 0);
+  for (p = r[0]; !is_null (p); p = cdr (p))
+    ASSERT (car (p) == make_char ('b'));
+
+  heap_destroy (&heap);
+
+  /* The tenured space grows in place with the live data and shrinks
+     only after several compactions have found it sparsely used. */
+  heap_init (&heap, 1ULL << 24);
+  heap.compact = true;
+  heap.pause_target = 0;
+  heap.tenuring_threshold = 1;
+  Pointer base = heap.start;
+  size_t size = (heap.end - heap.start) * WORDSIZE;
+  r[0] = make_null ();
+  for (int j = 0; j < 20; ++j)
+    {
+      for (int i = 0; i < 10000; ++i)
+	r[0] = cons (&heap, make_char ('g'), r[0]);
+      collect (&heap, r, 1);
+    }
+  ASSERT (heap.start == base);
+  ASSERT ((heap.end - heap.start) * WORDSIZE > size);
+  size = (heap.end - heap.start) * WORDSIZE;
+  r[0] = make_null ();
+  size_t compactions = 0;
+  while ((heap.end - heap.start) * WORDSIZE == size)
+    {
+      for (int i = 0; i < 10000; ++i)
+	r[0] = cons (&heap, make_char ('g'), i == 0 ? make_null () : r[0]);
+      collect (&heap, r, 1);
+      gc_telemetry_records (&heap.telemetry, records, 1);
+      if (records[0].kind == VM_GC_COMPACT)
+	++compactions;
+    }
+  ASSERT (compactions >= 3);
+  ASSERT (heap.start == base);
+  ASSERT (heap.emergencies == 0);
+
+  heap_destroy (&heap);
+
+  /* A heap that cannot grow enough to take the whole nursery is
+     collected as a whole. */
+  heap_init (&heap, 1ULL << 22);
+  r[0] = make_null ();
+  for (int i = 0; i < 100000; ++i)
+    r[0] = cons (&heap, make_char ('e'), r[0]);
+  collect (&heap, r, 1);
+  for (int i = 0; i < 200000; ++i)
+    cons (&heap, make_char ('f'), make_null ());
+  collect (&heap, r, 1);
+  ASSERT (heap.emergencies == 1);
+  ASSERT ((heap.end - heap.start) * WORDSIZE <= heap.heap_size);
+  size = 0;
+  for (p = r[0]; !is_null (p); p = cdr (p), ++size)
+    ASSERT (car (p) == make_char ('e'));
+  ASSERT (size == 100000);
+
+  heap_destroy (&heap);
+
+  /* Allocations are sampled and aggregated by site and type. */
+  heap_init (&heap, 1ULL << 24);
+  alloc_profile_start (&heap.alloc_profile, 1024);
+  for (int i = 0; i < 10000; ++i)
+    cons (&heap, make_null (), make_null ());
+  make_vector (&heap, 1000, make_null ());
+  FILE *out = tmpfile ();
+  alloc_profile_write (&heap.alloc_profile, out);
+  rewind (out);
+  char line[256];
+  size_t pairs = 0, vectors = 0;
+  while (fgets (line, sizeof line, out) != NULL)
+    {
+      size_t bytes, objects, samples;
+      char type[16];
+      void *site;
+      if (sscanf (line, "%zu %zu %zu %15s %p", &bytes, &objects, &samples, type, &site) != 5)
+	continue;
+      ASSERT (bytes == samples * 1024);
+      if (strcmp (type, "pair") == 0)
+	{
+	  ++pairs;
+	  ASSERT (bytes > 10000 * 2 * WORDSIZE - 1024 && bytes <= 10000 * 2 * WORDSIZE);
+	  ASSERT (objects == bytes / (2 * WORDSIZE));
+	}
+      else if (strcmp (type, "vector") == 0)
+	{
+	  ++vectors;
+	  ASSERT (bytes > 1002 * WORDSIZE - 1024 && bytes < 1002 * WORDSIZE + 1024);
+	  ASSERT (objects == 1);
+	}
+    }
+  ASSERT (pairs == 1 && vectors == 1);
+  fclose (out);
+
+  heap_destroy (&heap);
+
+  /* The fields of vectors are scanned in groups, skipping the
+     immediates. */
+  heap_init (&heap, 1ULL << 24);
+  heap.tenuring_threshold = 1;
+  r[0] = make_vector (&heap, 4099, make_char ('a'));
+  collect (&heap, r, 1);
+  for (int i = 0; i < 4099; i += 7)
+    vector_set (&heap, r[0], i, cons (&heap, make_char ('b'), make_null ()));
+  vector_set (&heap, r[0], 4098, cons (&heap, make_char ('c'), make_null ()));
+  collect (&heap, r, 1);
+  for (int i = 0; i < 4098; ++i)
+    {
+      Object field = vector_ref (r[0], i);
+      if (i % 7 == 0)
+	ASSERT (char_value (car (field)) == 'b');
+      else
+	ASSERT (char_value (field) == 'a');
+    }
+  ASSERT (char_value (car (vector_ref (r[0], 4098))) == 'c');
+  heap_destroy (&heap);
+
+  /* The objects frozen for sharing are neither moved nor written to
+     by the collections that follow, which compact the tenured space
+     around them.  Their whole pages are made read-only to catch any
+     write. */
+  heap_init (&heap, 1ULL << 24);
+  r[0] = r[1] = make_null ();
+  for (int i = 0; i < 10000; ++i)
+    {
+      r[0] = cons (&heap, make_char ('h'), r[0]);
+      r[1] = cons (&heap, make_char ('h'), r[1]);
+    }
+  heap_share (&heap, r, 2);
+  ASSERT (heap.frozen > heap.start && heap.frozen == heap.free);
+  size_t frozen = (heap.frozen - heap.start) * WORDSIZE;
+  char *image = xmemdup (heap.start, frozen);
+  size_t protected = frozen & -(size_t) getpagesize ();
+  ASSERT (protected > 0);
+  ASSERT (mprotect (heap.start, protected, PROT_READ) == 0);
+  Object list = r[0];
+  for (int j = 0; j < 20; ++j)
+    {
+      r[1] = make_null ();
+      for (int i = 0; i < 10000; ++i)
+	r[1] = cons (&heap, make_char ('i'), r[1]);
+      collect (&heap, r, 2);
+    }
+  heap.full = true;
+  collect (&heap, r, 2);
+  heap.full = false;
+  ASSERT (mprotect (heap.start, protected, PROT_READ | PROT_WRITE) == 0);
+  count = gc_telemetry_records (&heap.telemetry, records, GC_RECORDS);
+  compactions = 0;
+  for (size_t i = 0; i < count; ++i)
+    if (records[i].kind == VM_GC_COMPACT)
+      ++compactions;
+  ASSERT (compactions > 0);
+  ASSERT (r[0] == list);
+  ASSERT (memcmp (heap.start, image, frozen) == 0);
+  free (image);
+  int length = 0;
+  for (Object obj = list; !is_null (obj); obj = cdr (obj), ++length)
+    ASSERT (char_value (car (obj)) == 'h');
+  ASSERT (length == 10000);
+  /* A frozen object that has been made to refer to a moved one is
+     updated. */
+  mutate (&heap, (Pointer) list + 1, r[1]);
+  r[1] = make_null ();
+  for (int j = 0; j < 20; ++j)
+    {
+      for (int i = 0; i < 10000; ++i)
+	r[1] = cons (&heap, make_char ('i'), i == 0 ? make_null () : r[1]);
+      collect (&heap, r, 2);
+    }
+  ASSERT (char_value (car (cdr (list))) == 'i');
+  heap_destroy (&heap);
+
+  /* Neither a compaction around a pinned object nor a collection of a
+     tenured space that cannot grow any further writes to the frozen
+     objects. */
+  heap_init (&heap, 1ULL << 22);
+  heap.tenuring_threshold = 1;
+  r[0] = make_null ();
+  for (int i = 0; i < 20000; ++i)
+    r[0] = cons (&heap, make_char ('j'), r[0]);
+  heap_share (&heap, r, 1);
+  frozen = (heap.frozen - heap.start) * WORDSIZE;
+  image = xmemdup (heap.start, frozen);
+  protected = frozen & -(size_t) getpagesize ();
+  ASSERT (mprotect (heap.start, protected, PROT_READ) == 0);
+  base = heap.start;
+  r[1] = make_null ();
+  for (int i = 0; i < 10000; ++i)
+    r[1] = cons (&heap, make_char ('k'), r[1]);
+  r[2] = cons (&heap, make_char ('l'), make_null ());
+  collect (&heap, r, 3);
+  Object pinned = r[2];
+  pin (&heap, pinned);
+  r[1] = r[2] = make_null ();
+  heap.full = true;
+  collect (&heap, r, 3);
+  heap.full = false;
+  gc_telemetry_records (&heap.telemetry, records, 1);
+  ASSERT (records[0].kind == VM_GC_COMPACT);
+  ASSERT (char_value (car (pinned)) == 'l');
+  unpin (&heap, pinned);
+  r[1] = make_null ();
+  for (int i = 0; i < 100000; ++i)
+    r[1] = cons (&heap, make_char ('m'), r[1]);
+  collect (&heap, r, 3);
+  r[1] = make_null ();
+  for (int i = 0; i < 200000; ++i)
+    r[1] = cons (&heap, make_char ('n'), i % 100 == 0 ? make_null () : r[1]);
+  collect (&heap, r, 3);
+  ASSERT (heap.emergencies == 1);
+  gc_telemetry_records (&heap.telemetry, records, 1);
+  ASSERT (records[0].kind == VM_GC_COMPACT);
+  ASSERT (mprotect (heap.start, protected, PROT_READ | PROT_WRITE) == 0);
+  ASSERT (heap.start == base);
+  ASSERT (memcmp (heap.start, image, frozen) == 0);
+  free (image);
+  length = 0;
+  for (Object obj = r[0]; !is_null (obj); obj = cdr (obj), ++length)
+    ASSERT (char_value (car (obj)) == 'j');
+  ASSERT (length == 20000);
+  length = 0;
+  for (Object obj = r[1]; !is_null (obj); obj = cdr (obj), ++length)
+    ASSERT (char_value (car (obj)) == 'n');
+  ASSERT (length == 100);
   heap_destroy (&heap);
 }
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* Measure the time taken by traversals of lists built interleaved,
+   after a major collection has copied them in breadth-first or in
+   depth-first order, and the time taken by the collection.  The best
+   of five runs is printed for each order. */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <time.h>
+
+#include "vmcommon.h"
+
+#define RUNS 5
+#define LISTS 4000
+#define LENGTH 200
+#define TRAVERSALS 20
+
+static Heap heap;
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* A vector of LISTS lists, the pairs of which are allocated in turn,
+   so that those of each list lie far apart. */
+static Object
+make_lists (void)
+{
+  Object lists = make_vector (&heap, LISTS, make_null ());
+  for (int i = 0; i < LENGTH; ++i)
+    for (int j = 0; j < LISTS; ++j)
+      vector_set (&heap, lists, j,
+		  cons (&heap, make_char (i & 0xff), vector_ref (lists, j)));
+  return lists;
+}
+
+static void
+traverse (Object lists)
+{
+  for (int j = 0; j < LISTS; ++j)
+    for (Object p = vector_ref (lists, j); !is_null (p); p = cdr (p))
+      car (p);
+}
+
+static void
+bench (bool depth_first, double *collection, double *traversal)
+{
+  heap.depth_first = depth_first;
+  Object root = make_lists ();
+  heap.full = true;
+  double start = now ();
+  collect (&heap, &root, 1);
+  *collection = now () - start;
+  heap.full = false;
+  start = now ();
+  for (int i = 0; i < TRAVERSALS; ++i)
+    traverse (root);
+  *traversal = now () - start;
+  root = make_null ();
+  collect (&heap, &root, 1);
+}
+
+int
+main (int argc, char *argv)
+{
+  init ();
+  heap_init (&heap, 1ULL << 31);
+
+  struct
+  {
+    char const *name;
+    bool depth_first;
+    double collection;
+    double traversal;
+  } benches[] =
+      {
+	{ "breadth-first", false, 0, 0 },
+	{ "depth-first", true, 0, 0 }
+      };
+  size_t const bench_count = sizeof benches / sizeof benches[0];
+
+  for (int i = 0; i < RUNS; ++i)
+    for (size_t j = 0; j < bench_count; ++j)
+      {
+	double collection, traversal;
+	bench (benches[j].depth_first, &collection, &traversal);
+	if (i == 0 || collection < benches[j].collection)
+	  benches[j].collection = collection;
+	if (i == 0 || traversal < benches[j].traversal)
+	  benches[j].traversal = traversal;
+      }
+
+  for (size_t j = 0; j < bench_count; ++j)
+    printf ("%-14s collection %6.3f s  traversal %6.3f s\n", benches[j].name,
+	    benches[j].collection, benches[j].traversal);
+
+  heap_destroy (&heap);
+}
@@ -71,11 +71,32 @@ main (int argc, char *argv)
   
   p = make_string (heap, 2, 64);
   ASSERT (is_string (p));
-  string_set (p, 0, 65);
+  ASSERT (string_width (p) == 1);
+  string_set (heap, p, 0, 65);
   ASSERT (is_string (p));
   ASSERT (string_ref (p, 0) == 65);
   ASSERT (string_ref (p, 1) == 64);
   ASSERT (string_length (p) == 2);
+
+  /* Strings are widened as wider characters are stored. */
+  string_set (heap, p, 1, 0x3b1);
+  ASSERT (is_string (p));
+  ASSERT (string_width (p) == 2);
+  ASSERT (string_ref (p, 0) == 65);
+  ASSERT (string_ref (p, 1) == 0x3b1);
+  string_set (heap, p, 0, 0x1f600);
+  ASSERT (string_width (p) == 4);
+  ASSERT (string_length (p) == 2);
+  ASSERT (string_ref (p, 0) == 0x1f600);
+  ASSERT (string_ref (p, 1) == 0x3b1);
+  ASSERT (string_width (make_string (heap, 2, 0x3b1)) == 2);
+  ASSERT (string_width (string_from_utf8 (heap, u8"a\u03b1", strlen (u8"a\u03b1"))) == 2);
+
+  p = string (heap, list (heap, make_char ('a'), make_char ('b')));
+  ASSERT (string_length (p) == 2);
+  ASSERT (string_ref (p, 1) == 'b');
+  ASSERT (symbol (heap, list (heap, make_char ('a'), make_char ('b')))
+	  == make_symbol (heap, u8"ab", 2));
   
   p = make_vector (heap, 3, make_char ('a'));
   ASSERT (is_vector (p));
@@ -0,0 +1,34 @@
+(closure
+ (code
+  `((entry)
+    (movr %v2 %r0)
+    (alloc 2 %v2)
+    (movi %r0 $true)
+    (mov %v0 (cons %r0 %r0))
+    (movi %r1 7)
+    (pin %v0)
+    (bnei fail %r1 7)
+    (movi %v1 0)
+    loop
+    (beqi check %v1 1000000)
+    (alloc 2 %v2)
+    (movi %r0 $false)
+    (mov %r0 (cons %r0 %r0))
+    (addi %v1 %v1 1)
+    (jmpi loop)
+    check
+    (mov %r0 (car %v0))
+    (bnei fail %r0 $true)
+    (movi %r1 7)
+    (unpin %v0)
+    (bnei fail %r1 7)
+    (movi %r0 "ok")
+    (jmpi print)
+    fail
+    (movi %r0 "fail")
+    print
+    (prepare)
+    (pushargr %r0)
+    (finishi &puts)
+    (movi %r0 0)
+    (ret))))
@@ -55,6 +55,12 @@ main (int argc, char *argv)
 
   ASSERT (length (list (&heap, make_char ('a'), make_char ('b'))) == 2);
 
+  /* The pairs of a list are linked by initializing stores. */
+  p = list (&heap, make_char ('a'), make_char ('b'), make_char ('c'));
+  collect (&heap, &p, 1);
+  ASSERT (length (p) == 3);
+  ASSERT (car (cddr (p)) == make_char ('c'));
+
   p = inexact_number (&heap, 4.0, 0.0);
   ASSERT (flonum_d (p) == 4.0);
   
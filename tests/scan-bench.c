@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017  Marc Nieper-Wißkirchen
+ *
+ * This file is part of Thunder.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Thunder is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* Measure the time spent in minor collections that copy structures
+   whose objects are scanned in groups of fields or one field at a
+   time.  The best of five runs of 200 collections is printed. */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <time.h>
+
+#include "vmcommon.h"
+
+#define RUNS 5
+#define COLLECTIONS 200
+
+static Heap heap;
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* 16 vectors of 8192 immediates. */
+static Object
+make_immediates (void)
+{
+  Object root = make_null ();
+  for (int k = 0; k < 16; ++k)
+    root = cons (&heap, make_vector (&heap, 8192, make_char (k)), root);
+  return root;
+}
+
+/* The same, but every eighth field refers to a pair. */
+static Object
+make_sparse (void)
+{
+  Object root = make_null ();
+  for (int k = 0; k < 16; ++k)
+    {
+      Object v = make_vector (&heap, 8192, make_char (k));
+      for (int i = 0; i < 8192; i += 8)
+	vector_set (&heap, v, i, cons (&heap, make_null (), make_null ()));
+      root = cons (&heap, v, root);
+    }
+  return root;
+}
+
+/* A list of 131072 pairs. */
+static Object
+make_list (void)
+{
+  Object root = make_null ();
+  for (int k = 0; k < 131072; ++k)
+    root = cons (&heap, make_char (k & 0xff), root);
+  return root;
+}
+
+static double
+bench (Object (*make) (void))
+{
+  double total = 0;
+  Object root;
+  for (int i = 0; i < COLLECTIONS; ++i)
+    {
+      root = make ();
+      double start = now ();
+      collect (&heap, &root, 1);
+      total += now () - start;
+      root = make_null ();
+      collect (&heap, &root, 1);
+    }
+  return total;
+}
+
+int
+main (int argc, char *argv)
+{
+  init ();
+  heap_init (&heap, 1ULL << 31);
+
+  struct
+  {
+    char const *name;
+    Object (*make) (void);
+    double best;
+  } benches[] =
+      {
+	{ "16 vectors of 8192 immediates", make_immediates, 0 },
+	{ "same, every 8th field a pair", make_sparse, 0 },
+	{ "list of 131072 pairs", make_list, 0 }
+      };
+  size_t const bench_count = sizeof benches / sizeof benches[0];
+
+  for (int i = 0; i < RUNS; ++i)
+    for (size_t j = 0; j < bench_count; ++j)
+      {
+	double time = bench (benches[j].make);
+	if (i == 0 || time < benches[j].best)
+	  benches[j].best = time;
+      }
+
+  for (size_t j = 0; j < bench_count; ++j)
+    printf ("%-30s %6.3f s\n", benches[j].name, benches[j].best);
+
+  heap_destroy (&heap);
+}
@@ -86,6 +86,7 @@ int main (int argc, char *argv[])
   ASSERT (check_write (u8"#\\\n", "#\\newline"));
   ASSERT (check_write (u8"symbol", "symbol"));
   ASSERT (check_write (u8"\"str\\\\ing\"", "\"str\\\\ing\""));
+  ASSERT (check_write (u8"\"str\\\"ing\"", "\"str\\\"ing\""));
   ASSERT (check_write (u8"#(a #(b c))", "#(a #(b c))"));
   ASSERT (check_write (u8"(a (b c))", "(a (b c))"));
   ASSERT (check_write (u8"(a (b . c) d)", "(a (b . c) d)"));